@@ -1,28 +1,147 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <ctime>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <span>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
-class Minesweeper {
+// xoshiro256** by Blackman and Vigna, seeded through splitmix64. Fast enough to draw a mine
+// position per call, and every game owns its own.
+class Xoshiro256 {
 public:
-    using RenderedField = std::vector<std::string>;
+    using result_type = uint64_t;
+
+    explicit Xoshiro256(uint64_t seed) {
+        for (auto& word : state_) {
+            seed += 0x9E3779B97F4A7C15;
+            uint64_t mixed = (seed ^ (seed >> 30)) * 0xBF58476D1CE4E5B9;
+            mixed = (mixed ^ (mixed >> 27)) * 0x94D049BB133111EB;
+            word = mixed ^ (mixed >> 31);
+        }
+    }
+
+    static constexpr result_type min() {
+        return 0;
+    }
+
+    static constexpr result_type max() {
+        return UINT64_MAX;
+    }
+
+    result_type operator()() {
+        uint64_t result = std::rotl(state_[1] * 5, 7) * 9;
+        uint64_t shifted = state_[1] << 17;
+        state_[2] ^= state_[0];
+        state_[3] ^= state_[1];
+        state_[1] ^= state_[2];
+        state_[0] ^= state_[3];
+        state_[2] ^= shifted;
+        state_[3] = std::rotl(state_[3], 45);
+        return result;
+    }
+
+    // A uniformly distributed number below bound: random bits are masked to the width of bound and
+    // drawn again while they are not below it, which takes less than two draws on average.
+    uint64_t GetBelow(uint64_t bound) {
+        uint64_t mask = UINT64_MAX >> std::countl_zero((bound - 1) | 1);
+
+        while (true) {
+            uint64_t value = (*this)() & mask;
+
+            if (value < bound) {
+                return value;
+            }
+        }
+    }
+
+private:
+    std::array<uint64_t, 4> state_;
+};
+
+// Chooses mines_count distinct cells of cells_count, numbered row by row, uniformly at random by
+// Floyd's sampling: one random number per mine. add_mine(number) places a mine in a cell and
+// returns false if there is one already. Every kind of game places its mines with it, so that the
+// same seed places them in the same cells.
+template <typename AddMine>
+void PlaceRandomMines(uint64_t seed, size_t cells_count, size_t mines_count, AddMine&& add_mine) {
+    Xoshiro256 random(seed);
 
+    for (size_t last = cells_count - std::min(mines_count, cells_count); last < cells_count; ++last) {
+        if (!add_mine(random.GetBelow(last + 1))) {
+            add_mine(last);
+        }
+    }
+}
+
+// The layout of a field of width by height cells in a frame one cell wide, row by row. Every cell
+// of the field has its eight near cells at fixed offsets, so that nothing has to check bounds as
+// long as the frame is told apart. Minesweeper keeps its field this way, and MinesweeperSolver what
+// it knows of the field.
+class FramedGrid {
+public:
     struct Cell {
         size_t x = 0;
         size_t y = 0;
     };
 
-    enum class CellContent {
-        EMPTY,
-        MINE,
-    };
+    FramedGrid() = default;
 
-    struct CellInfo {
-        bool opened = false;
-        bool flaged = false;
-        CellContent content = CellContent::EMPTY;
-        int64_t number_of_mines_in_near_cells = 0;
-    };
+    FramedGrid(size_t width, size_t height) : width_(width), height_(height) {}
+
+    size_t GetWidth() const {
+        return width_;
+    }
+
+    size_t GetHeight() const {
+        return height_;
+    }
+
+    // Lays out cells with border in the frame and value in the field.
+    template <typename T>
+    void Fill(std::vector<T>& cells, T border, T value) const {
+        cells.assign((width_ + 2) * (height_ + 2), border);
+
+        for (size_t y = 0; y < height_; ++y) {
+            std::fill_n(cells.data() + GetIndex({0, y}), width_, value);
+        }
+    }
+
+    size_t GetIndex(const Cell& cell) const {
+        return (cell.y + 1) * (width_ + 2) + cell.x + 1;
+    }
+
+    Cell GetCell(size_t index) const {
+        return {index % (width_ + 2) - 1, index / (width_ + 2) - 1};
+    }
+
+    std::array<ptrdiff_t, 8> GetNearCellOffsets() const {
+        ptrdiff_t stride = static_cast<ptrdiff_t>(width_ + 2);
+        return {-stride - 1, -stride, -stride + 1, -1, 1, stride - 1, stride, stride + 1};
+    }
+
+private:
+    size_t width_ = 0;
+    size_t height_ = 0;
+};
+
+class Minesweeper {
+public:
+    using RenderedField = std::vector<std::string>;
+
+    using Cell = FramedGrid::Cell;
 
     enum class GameStatus {
         NOT_STARTED,
@@ -31,90 +150,281 @@ public:
         DEFEAT,
     };
 
-    Minesweeper(size_t width, size_t height, size_t mines_count) : mines_(mines_count), titles_(width * height) {
-        if (mines_count >= width * height) {
-            field_ = std::vector<std::vector<CellInfo>>(
-                height, std::vector<CellInfo>(width, CellInfo({false, false, CellContent::MINE, 0})));
-        } else {
-            field_ = std::vector<std::vector<CellInfo>>(height, std::vector<CellInfo>(width));
-            if (mines_count > 0) {
-                FillField();
-            }
-        }
+    // The same seed places the mines in the same cells.
+    Minesweeper(size_t width, size_t height, size_t mines_count, uint64_t seed = std::random_device()()) {
+        NewGame(width, height, mines_count, seed);
     }
 
-    Minesweeper(size_t width, size_t height, const std::vector<Cell>& cells_with_mines)
-        : field_(height, std::vector<CellInfo>(width)), mines_(cells_with_mines.size()), titles_(width * height) {
-        for (const auto& cell : cells_with_mines) {
-            field_[cell.y][cell.x].content = CellContent::MINE;
-        }
+    Minesweeper(size_t width, size_t height, const std::vector<Cell>& cells_with_mines) {
+        NewGame(width, height, cells_with_mines);
     }
 
-    void NewGame(size_t width, size_t height, size_t mines_count) {
-        Restart(mines_count, width * height);
-
-        if (mines_count >= width * height) {
-            field_ = std::vector<std::vector<CellInfo>>(
-                height, std::vector<CellInfo>(width, CellInfo({false, false, CellContent::MINE, 0})));
-        } else {
-            field_ = std::vector<std::vector<CellInfo>>(height, std::vector<CellInfo>(width));
-            if (mines_count > 0) {
-                FillField();
-            }
-        }
+    // Places as many of the mines as fit in the field.
+    void NewGame(size_t width, size_t height, size_t mines_count, uint64_t seed = std::random_device()()) {
+        Restart(width, height);
+        seed_ = seed;
+        PlaceRandomMines(seed, width * height, mines_count, [this, width](size_t number) {
+            return AddMine(grid_.GetIndex({number % width, number / width}));
+        });
+        CountNearMines();
     }
 
     void NewGame(size_t width, size_t height, const std::vector<Cell>& cells_with_mines) {
-        field_ = std::vector<std::vector<CellInfo>>(height, std::vector<CellInfo>(width));
-        Restart(cells_with_mines.size(), width * height);
+        Restart(width, height);
 
         for (const auto& cell : cells_with_mines) {
-            field_[cell.y][cell.x].content = CellContent::MINE;
+            AddMine(grid_.GetIndex(cell));
         }
+
+        CountNearMines();
     }
 
-    void OpenCell(const Cell& cell) {
+    // Returns the cells opened by the move, which stay valid until the next move.
+    std::span<const Cell> OpenCell(const Cell& cell) {
+        BeginMove(MoveType::OPEN);
+        size_t version = GetVersion();
+
         if (game_status_ == GameStatus::NOT_STARTED) {
             game_status_ = GameStatus::IN_PROGRESS;
             time(&game_time_);
         }
 
         if (game_status_ == GameStatus::IN_PROGRESS) {
-            if (field_[cell.y][cell.x].content == CellContent::MINE) {
-                for (auto& line : field_) {
-                    OpenLine(line);
-                }
+            size_t index = grid_.GetIndex(cell);
 
+            if (field_[index] & MINE) {
+                OpenField();
                 game_status_ = GameStatus::DEFEAT;
                 game_time_ = static_cast<time_t>(difftime(time(nullptr), game_time_));
             } else {
-                if (field_[cell.y][cell.x].opened) {
-                    return;
+                if (field_[index] & OPENED) {
+                    EndMove();
+                    return {};
+                }
+
+                if (field_[index] & FLAGGED) {
+                    if (journaling_) {
+                        moves_.back().cleared_flag = true;
+                    }
+
+                    ToggleFlag(index);
                 }
 
-                field_[cell.y][cell.x].flaged = false;
-                std::vector<Cell> buff;
-                field_[cell.y][cell.x].opened = true;
+                field_[index] |= OPENED;
                 ++opened_cell_number_;
-                Infect(buff, cell);
+                Infect(index);
 
-                if (mines_ + opened_cell_number_ == titles_) {
+                if (GetSafeCellsLeftCount() == 0) {
                     game_status_ = GameStatus::VICTORY;
                     game_time_ = static_cast<time_t>(difftime(std::time(nullptr), game_time_));
                 }
             }
         }
+
+        EndMove();
+        return GetChangedCells(version);
     }
 
     void MarkCell(const Cell& cell) {
+        BeginMove(MoveType::MARK);
+
         if (game_status_ == GameStatus::NOT_STARTED) {
             game_status_ = GameStatus::IN_PROGRESS;
             time(&game_time_);
         }
 
-        if (game_status_ == GameStatus::IN_PROGRESS && field_[cell.y][cell.x].opened == false) {
-            field_[cell.y][cell.x].flaged = !field_[cell.y][cell.x].flaged;
+        if (game_status_ == GameStatus::IN_PROGRESS && !(field_[grid_.GetIndex(cell)] & OPENED)) {
+            ToggleFlag(grid_.GetIndex(cell));
+            changed_cells_.push_back(cell);
         }
+
+        EndMove();
+    }
+
+    // Takes back the last move that changed the game, in time proportional to the cells it changed.
+    // The log of changes is cut back to where the move started, which starts a new generation of
+    // it, so clients render the whole field again. At least the last MAX_UNDO_MOVES moves can be
+    // taken back. Returns false if there is no move to take back.
+    bool Undo() {
+        if (moves_.empty()) {
+            return false;
+        }
+
+        Move move = moves_.back();
+        moves_.pop_back();
+
+        for (size_t i = move.first_change; i < move.last_change; ++i) {
+            Cell cell = changed_cells_[i];
+
+            if (move.type == MoveType::OPEN) {
+                field_[grid_.GetIndex(cell)] &= ~OPENED;
+            } else {
+                ToggleFlag(grid_.GetIndex(cell));
+            }
+        }
+
+        if (move.cleared_flag) {
+            ToggleFlag(grid_.GetIndex(changed_cells_[move.first_change]));
+        }
+
+        changed_cells_.resize(move.first_change);
+        ++generation_;
+
+        game_status_ = move.game_status;
+        game_time_ = move.game_time;
+        opened_cell_number_ = move.opened_cell_number;
+
+        return true;
+    }
+
+    // The journal of moves and the log of changes cost a little on every move. Games that are only
+    // played, as in a batch, can turn them off: no move can be taken back then, and the log holds
+    // the changes of the last move only, as every move starts a new generation of it.
+    void SetJournaling(bool enabled) {
+        journaling_ = enabled;
+
+        if (!enabled) {
+            moves_.clear();
+        }
+    }
+
+    // The state of the game in a compact form: a header, then the mines, the opened cells and the
+    // flagged cells as bitmaps of a bit per cell, row by row. Moves cannot be taken back past a
+    // saved state once it is loaded.
+    std::vector<uint8_t> SaveState() const {
+        StateHeader header = {.width = grid_.GetWidth(),
+                              .height = grid_.GetHeight(),
+                              .mines_count = mines_,
+                              .seed = seed_,
+                              .opened_cell_number = opened_cell_number_,
+                              .game_time = static_cast<int64_t>(game_time_),
+                              .game_status = static_cast<uint64_t>(game_status_)};
+        std::copy(std::begin(STATE_MAGIC), std::end(STATE_MAGIC), header.magic);
+
+        size_t bitmap_size = GetBitmapSize(grid_.GetWidth(), grid_.GetHeight());
+        std::vector<uint8_t> state(sizeof(header) + 3 * bitmap_size, 0);
+        std::memcpy(state.data(), &header, sizeof(header));
+        uint8_t* bitmaps = state.data() + sizeof(header);
+
+        for (size_t y = 0, bit = 0; y < grid_.GetHeight(); ++y) {
+            for (size_t x = 0; x < grid_.GetWidth(); ++x, ++bit) {
+                uint8_t cell = field_[grid_.GetIndex({x, y})];
+                uint8_t mask = static_cast<uint8_t>(1 << (bit % 8));
+                bitmaps[bit / 8] |= (cell & MINE) ? mask : 0;
+                bitmaps[bitmap_size + bit / 8] |= (cell & OPENED) ? mask : 0;
+                bitmaps[2 * bitmap_size + bit / 8] |= (cell & FLAGGED) ? mask : 0;
+            }
+        }
+
+        return state;
+    }
+
+    // Restores a state made by SaveState. The game is left as it was if the state is not valid.
+    // The log of changes starts again from version 0, in a new generation.
+    bool LoadState(std::span<const uint8_t> state) {
+        StateHeader header;
+
+        if (state.size() < sizeof(header)) {
+            return false;
+        }
+
+        std::memcpy(&header, state.data(), sizeof(header));
+
+        if (!std::equal(std::begin(STATE_MAGIC), std::end(STATE_MAGIC), header.magic) ||
+            header.version != STATE_VERSION || header.game_status > static_cast<uint64_t>(GameStatus::DEFEAT) ||
+            header.width > MAX_STATE_SIDE || header.height > MAX_STATE_SIDE ||
+            state.size() != sizeof(header) + 3 * GetBitmapSize(header.width, header.height) ||
+            header.mines_count + header.opened_cell_number > header.width * header.height) {
+            return false;
+        }
+
+        size_t bitmap_size = GetBitmapSize(header.width, header.height);
+        const uint8_t* bitmaps = state.data() + sizeof(header);
+        auto get_bit = [&](size_t bitmap, size_t bit) {
+            return (bitmaps[bitmap * bitmap_size + bit / 8] >> (bit % 8)) & 1;
+        };
+
+        // The counters are kept along with the field, so they have to agree with it. Only a lost
+        // game has opened mines and flags, as it opens every cell; the opened cells it does not count.
+        bool defeat = header.game_status == static_cast<uint64_t>(GameStatus::DEFEAT);
+        size_t mines_count = 0;
+        size_t opened_count = 0;
+
+        for (size_t bit = 0; bit < header.width * header.height; ++bit) {
+            bool mine = get_bit(0, bit);
+            bool opened = get_bit(1, bit);
+
+            if (defeat ? !opened : opened && (mine || get_bit(2, bit))) {
+                return false;
+            }
+
+            mines_count += mine ? 1 : 0;
+            opened_count += opened ? 1 : 0;
+        }
+
+        if (mines_count != header.mines_count || (!defeat && opened_count != header.opened_cell_number)) {
+            return false;
+        }
+
+        Restart(header.width, header.height);
+        seed_ = header.seed;
+        opened_cell_number_ = header.opened_cell_number;
+        game_time_ = static_cast<time_t>(header.game_time);
+        game_status_ = static_cast<GameStatus>(header.game_status);
+
+        for (size_t y = 0, bit = 0; y < grid_.GetHeight(); ++y) {
+            for (size_t x = 0; x < grid_.GetWidth(); ++x, ++bit) {
+                size_t index = grid_.GetIndex({x, y});
+
+                if (get_bit(0, bit)) {
+                    AddMine(index);
+                }
+
+                if (get_bit(1, bit)) {
+                    field_[index] |= OPENED;
+                }
+
+                if (get_bit(2, bit)) {
+                    ToggleFlag(index);
+                }
+            }
+        }
+
+        CountNearMines();
+
+        return true;
+    }
+
+    size_t GetWidth() const {
+        return grid_.GetWidth();
+    }
+
+    size_t GetHeight() const {
+        return grid_.GetHeight();
+    }
+
+    // Every change of how a cell is rendered is logged, and the version of the field is the number
+    // of changes so far. A new game starts again from version 0.
+    size_t GetVersion() const {
+        return changed_cells_.size();
+    }
+
+    // Changes before a version are known only within the generation it was taken in. A new game,
+    // a loaded state, a move taken back and old moves dropped from the journal cut the log and
+    // start a new generation, after which clients have to render the whole field again.
+    uint64_t GetGeneration() const {
+        return generation_;
+    }
+
+    // Cells rendered differently since the version, in the order of the changes. A cell is listed
+    // once per change.
+    std::span<const Cell> GetChangedCells(size_t version) const {
+        return std::span<const Cell>(changed_cells_).subspan(std::min(version, changed_cells_.size()));
+    }
+
+    // The seed the mines were placed with, if they were.
+    uint64_t GetSeed() const {
+        return seed_;
     }
 
     GameStatus GetGameStatus() const {
@@ -122,141 +432,1296 @@ public:
     }
 
     time_t GetGameTime() const {
-        switch (game_status_) {
-            case Minesweeper::GameStatus::NOT_STARTED:
+        return GetGameTime(game_status_, game_time_);
+    }
+
+    // The time a game has taken so far, by its game_time: the time it started at while it is in
+    // progress, and the time it took once it is finished.
+    static time_t GetGameTime(GameStatus game_status, time_t game_time) {
+        switch (game_status) {
+            case GameStatus::NOT_STARTED:
                 return static_cast<time_t>(0);
-            case Minesweeper::GameStatus::IN_PROGRESS:
-                return static_cast<time_t>(difftime(std::time(nullptr), game_time_));
-            case Minesweeper::GameStatus::VICTORY:
-                return game_time_;
-            case Minesweeper::GameStatus::DEFEAT:
-                return game_time_;
+            case GameStatus::IN_PROGRESS:
+                return static_cast<time_t>(difftime(std::time(nullptr), game_time));
+            case GameStatus::VICTORY:
+            case GameStatus::DEFEAT:
+                break;
         }
+
+        return game_time;
     }
 
     RenderedField RenderField() const {
-        std::vector<std::string> snapshot;
+        std::vector<std::string> snapshot(grid_.GetHeight(), std::string(grid_.GetWidth(), '-'));
 
-        for (const auto& line : field_) {
-            std::string temp;
+        for (size_t y = 0; y < grid_.GetHeight(); ++y) {
+            RenderLine(y, snapshot[y].data());
+        }
 
-            for (const auto& cell : line) {
-                if (cell.flaged == true) {
-                    temp += '?';
-                    continue;
-                }
+        return snapshot;
+    }
 
-                if (!cell.opened) {
-                    temp += '-';
-                    continue;
-                }
+    // Writes the rendered field row by row into grid. Writes nothing and returns false if grid
+    // holds less than width * height chars.
+    bool RenderField(std::span<char> grid) const {
+        if (grid.size() < grid_.GetWidth() * grid_.GetHeight()) {
+            return false;
+        }
 
-                if (cell.content == CellContent::MINE) {
-                    temp += '*';
-                    continue;
-                }
+        for (size_t y = 0; y < grid_.GetHeight(); ++y) {
+            RenderLine(y, grid.data() + y * grid_.GetWidth());
+        }
 
-                if (cell.number_of_mines_in_near_cells == 0) {
-                    temp += '.';
-                    continue;
-                }
+        return true;
+    }
 
-                temp += std::to_string(cell.number_of_mines_in_near_cells);
-            }
+    char RenderCell(const Cell& cell) const {
+        return GetCellSymbol(field_[grid_.GetIndex(cell)]);
+    }
+
+    // The number of mines in the near cells of an opened cell without a mine. Nothing is told about
+    // other cells, so that solvers only see what the player sees.
+    std::optional<size_t> GetNearMinesCount(const Cell& cell) const {
+        uint8_t value = field_[grid_.GetIndex(cell)];
 
-            snapshot.emplace_back(temp);
+        if (!(value & OPENED) || (value & MINE)) {
+            return std::nullopt;
         }
 
-        return snapshot;
+        return value & NEAR_MINES_MASK;
+    }
+
+    // The number of mines on the field, which is less than asked for if they do not fit.
+    size_t GetMinesCount() const {
+        return mines_;
+    }
+
+    size_t GetFlagsCount() const {
+        return flags_count_;
+    }
+
+    // Flags on cells with mines. This tells about closed cells, so it is meant for scoring players
+    // rather than for showing to them.
+    size_t GetCorrectFlagsCount() const {
+        return correct_flags_count_;
+    }
+
+    // Mines less flags, as the counter of the game shows it. Negative if there are more flags.
+    int64_t GetMinesLeftCount() const {
+        return static_cast<int64_t>(mines_) - static_cast<int64_t>(flags_count_);
+    }
+
+    // Closed cells without mines. The game is won once there are none.
+    size_t GetSafeCellsLeftCount() const {
+        return titles_ - mines_ - opened_cell_number_;
     }
 
 private:
-    CellInfo MineGenerator() {
-        CellInfo temp;
+    // A cell takes one byte: the number of mines in the near cells in the low bits and its state in
+    // the high ones. The field is surrounded by a frame of BORDER cells, so that the near cells of
+    // every cell of the field can be visited without bounds checks.
+    static constexpr uint8_t NEAR_MINES_MASK = 0x0F;
+    static constexpr uint8_t MINE = 0x10;
+    static constexpr uint8_t OPENED = 0x20;
+    static constexpr uint8_t FLAGGED = 0x40;
+    static constexpr uint8_t BORDER = 0x80;
+
+    enum class MoveType {
+        OPEN,
+        MARK,
+    };
+
+    // An entry of the journal of moves: the cells it changed are a range of the log of changes, and
+    // the state of the game before it is kept to be restored.
+    struct Move {
+        MoveType type = MoveType::OPEN;
+        size_t first_change = 0;
+        size_t last_change = 0;
+        bool cleared_flag = false;
+        GameStatus game_status = GameStatus::NOT_STARTED;
+        time_t game_time = 0;
+        size_t opened_cell_number = 0;
+    };
+
+    struct StateHeader {
+        char magic[8] = {};
+        uint64_t version = STATE_VERSION;
+        uint64_t width = 0;
+        uint64_t height = 0;
+        uint64_t mines_count = 0;
+        uint64_t seed = 0;
+        uint64_t opened_cell_number = 0;
+        int64_t game_time = 0;
+        uint64_t game_status = 0;
+    };
+
+    static constexpr char STATE_MAGIC[8] = {'M', 'I', 'N', 'E', 'S', 'W', 'P', '\0'};
+    static constexpr uint64_t STATE_VERSION = 1;
+    // Keeps the size of a loaded field with its frame from overflowing.
+    static constexpr uint64_t MAX_STATE_SIDE = uint64_t{1} << 24;
 
-        if (mine_counter_ == mines_) {
-            return temp;
+    // Older moves are dropped from the journal, along with their part of the log of changes, so that
+    // neither grows without bound however long a game is played.
+    static constexpr size_t MAX_UNDO_MOVES = 1024;
+
+    static size_t GetBitmapSize(size_t width, size_t height) {
+        return (width * height + 7) / 8;
+    }
+
+    void BeginMove(MoveType type) {
+        if (!journaling_) {
+            changed_cells_.clear();
+            ++generation_;
+            return;
         }
 
-        if (rand() % 2) {
-            temp.content = CellContent::MINE;
-            ++mine_counter_;
+        if (moves_.size() == 2 * MAX_UNDO_MOVES) {
+            DropOldMoves();
         }
 
-        return temp;
+        moves_.push_back({.type = type,
+                          .first_change = GetVersion(),
+                          .last_change = GetVersion(),
+                          .cleared_flag = false,
+                          .game_status = game_status_,
+                          .game_time = game_time_,
+                          .opened_cell_number = opened_cell_number_});
+    }
+
+    // Drops the older half of the journal in one go, so that the moves left and the log are shifted
+    // once per MAX_UNDO_MOVES moves. The log is cut, which starts a new generation.
+    void DropOldMoves() {
+        size_t dropped_changes = moves_[MAX_UNDO_MOVES].first_change;
+        moves_.erase(moves_.begin(), moves_.begin() + MAX_UNDO_MOVES);
+        changed_cells_.erase(changed_cells_.begin(), changed_cells_.begin() + dropped_changes);
+        ++generation_;
+
+        for (Move& move : moves_) {
+            move.first_change -= dropped_changes;
+            move.last_change -= dropped_changes;
+        }
     }
 
-    void FillLine(std::vector<CellInfo>& line) {
-        for (auto& cell : line) {
-            cell = MineGenerator();
+    // Keeps the move in the journal only if it changed the game.
+    void EndMove() {
+        if (!journaling_) {
+            return;
+        }
+
+        Move& move = moves_.back();
+        move.last_change = GetVersion();
+
+        if (move.first_change == move.last_change && move.game_status == game_status_) {
+            moves_.pop_back();
         }
     }
 
-    void OpenLine(std::vector<CellInfo>& line) {
-        for (auto& cell : line) {
-            cell.opened = true;
+    static char GetCellSymbol(uint8_t cell) {
+        if (cell & FLAGGED) {
+            return '?';
+        }
+
+        if (!(cell & OPENED)) {
+            return '-';
+        }
+
+        if (cell & MINE) {
+            return '*';
+        }
+
+        if ((cell & NEAR_MINES_MASK) == 0) {
+            return '.';
         }
+
+        return static_cast<char>('0' + (cell & NEAR_MINES_MASK));
     }
 
-    void FillField() {
-        for (auto& line : field_) {
-            FillLine(line);
+    void RenderLine(size_t y, char* symbols) const {
+        const uint8_t* line = field_.data() + grid_.GetIndex({0, y});
+
+        for (size_t x = 0, width = grid_.GetWidth(); x < width; ++x) {
+            symbols[x] = GetCellSymbol(line[x]);
         }
     }
 
-    void Infect(std::vector<Cell>& cluster, const Cell& cell) {
-        cluster.emplace_back(cell);
-        int64_t number_of_mines = 0;
-        bool infect_further = true;
-        std::vector<Cell> next_cells;
+    // Returns false if the cell has a mine already.
+    bool AddMine(size_t index) {
+        if (field_[index] & MINE) {
+            return false;
+        }
 
-        for (int i = -1; i <= 1; ++i) {
-            for (int j = -1; j <= 1; ++j) {
-                if (!((i != 0 || j != 0) && cell.y + i < field_.size() && cell.x + j < field_[0].size() &&
-                      cell.x + j >= 0 && cell.y + i >= 0)) {
-                    continue;
-                }
+        field_[index] |= MINE;
+        ++mines_;
 
-                if (field_[cell.y + i][cell.x + j].content == CellContent::MINE) {
-                    infect_further = false;
-                    ++number_of_mines;
-                    continue;
-                }
+        return true;
+    }
 
-                if (infect_further && !field_[cell.y + i][cell.x + j].opened &&
-                    !field_[cell.y + i][cell.x + j].flaged) {
-                    next_cells.push_back({cell.x + j, cell.y + i});
+    void ToggleFlag(size_t index) {
+        field_[index] ^= FLAGGED;
+        size_t added = (field_[index] & FLAGGED) ? 1 : static_cast<size_t>(-1);
+        flags_count_ += added;
+        correct_flags_count_ += (field_[index] & MINE) ? added : 0;
+    }
+
+    void OpenField() {
+        for (size_t y = 0; y < grid_.GetHeight(); ++y) {
+            for (size_t x = 0; x < grid_.GetWidth(); ++x) {
+                uint8_t& cell = field_[grid_.GetIndex({x, y})];
+
+                if (!(cell & OPENED)) {
+                    cell |= OPENED;
+                    changed_cells_.push_back({x, y});
                 }
             }
         }
+    }
 
-        field_[cell.y][cell.x].number_of_mines_in_near_cells = number_of_mines;
+    // Stores the number of mines in the near cells of every cell. The mines of three rows are first
+    // summed up by column and then across three columns, both in loops that vectorize.
+    void CountNearMines() {
+        size_t width = grid_.GetWidth();
+        size_t stride = width + 2;
+        column_mines_.resize(stride);
+        uint8_t* column_mines = column_mines_.data();
 
-        if (infect_further) {
-            for (const auto& next_cell : next_cells) {
-                field_[next_cell.y][next_cell.x].opened = true;
-                ++opened_cell_number_;
+        for (size_t y = 0; y < grid_.GetHeight(); ++y) {
+            uint8_t* line = field_.data() + grid_.GetIndex({0, y}) - 1;
+            const uint8_t* upper_line = line - stride;
+            const uint8_t* lower_line = line + stride;
+
+            for (size_t x = 0; x < stride; ++x) {
+                column_mines[x] = (upper_line[x] & MINE) + (line[x] & MINE) + (lower_line[x] & MINE);
+            }
+
+            for (size_t x = 1; x <= width; ++x) {
+                uint8_t mines = column_mines[x - 1] + column_mines[x] + column_mines[x + 1] - (line[x] & MINE);
+                line[x] = (line[x] & ~NEAR_MINES_MASK) | (mines / MINE);
             }
+        }
+    }
+
+    // Opens the near cells of the just opened cell at index as long as they have no mines in their
+    // near cells, breadth first. The queue of opened cells is kept between moves, so that a move
+    // does not allocate once it has grown.
+    void Infect(size_t index) {
+        std::array<ptrdiff_t, 8> near_cell_offsets = grid_.GetNearCellOffsets();
+        infect_queue_.assign(1, index);
+
+        for (size_t i = 0; i < infect_queue_.size(); ++i) {
+            size_t current = infect_queue_[i];
 
-            for (const auto& next_cell : next_cells) {
-                Infect(cluster, next_cell);
+            if (field_[current] & NEAR_MINES_MASK) {
+                continue;
+            }
+
+            for (ptrdiff_t offset : near_cell_offsets) {
+                size_t near_index = current + static_cast<size_t>(offset);
+
+                if (!(field_[near_index] & (OPENED | FLAGGED | BORDER))) {
+                    field_[near_index] |= OPENED;
+                    ++opened_cell_number_;
+                    infect_queue_.push_back(near_index);
+                }
             }
         }
+
+        for (size_t opened_index : infect_queue_) {
+            changed_cells_.push_back(grid_.GetCell(opened_index));
+        }
     }
 
-    void Restart(const size_t& mines_count, const size_t& title_count) {
+    void Restart(size_t width, size_t height) {
         game_status_ = GameStatus::NOT_STARTED;
-        mine_counter_ = 0;
+        seed_ = 0;
         opened_cell_number_ = 0;
-        mines_ = mines_count;
-        titles_ = title_count;
+        changed_cells_.clear();
+        ++generation_;
+        moves_.clear();
+        mines_ = 0;
+        flags_count_ = 0;
+        correct_flags_count_ = 0;
+        titles_ = width * height;
+        grid_ = FramedGrid(width, height);
+        grid_.Fill(field_, BORDER, uint8_t{0});
     }
 
     GameStatus game_status_ = GameStatus::NOT_STARTED;
-    std::vector<std::vector<CellInfo>> field_;
-    time_t game_time_;
+    FramedGrid grid_;
+    // Cells of the field with its frame, laid out by grid_.
+    std::vector<uint8_t> field_;
+    std::vector<size_t> infect_queue_;
+    std::vector<uint8_t> column_mines_;
+    // The log of changes behind GetVersion.
+    std::vector<Cell> changed_cells_;
+    uint64_t generation_ = 0;
+    std::vector<Move> moves_;
+    bool journaling_ = true;
+    time_t game_time_ = 0;
     size_t opened_cell_number_ = 0;
-    size_t mine_counter_ = 0;
+    uint64_t seed_ = 0;
     size_t mines_ = 0;
+    size_t flags_count_ = 0;
+    size_t correct_flags_count_ = 0;
     size_t titles_ = 0;
-};
\ No newline at end of file
+};
+
+// Games of the same size that are played in parallel, for simulations that play a lot of them. Every
+// game keeps its field between rounds, so new games and moves do not allocate once it has grown.
+class MinesweeperBatch {
+public:
+    enum class MoveType {
+        OPEN,
+        MARK,
+    };
+
+    struct Move {
+        size_t game = 0;
+        Minesweeper::Cell cell;
+        MoveType type = MoveType::OPEN;
+    };
+
+    // Game i places its mines with seed + i. The games keep no journal, so their moves cannot be
+    // taken back.
+    MinesweeperBatch(size_t games_count, size_t width, size_t height, size_t mines_count, uint64_t seed)
+        : width_(width), height_(height), mines_count_(mines_count) {
+        games_.reserve(games_count);
+
+        for (size_t i = 0; i < games_count; ++i) {
+            games_.emplace_back(width, height, mines_count, seed + i);
+            games_.back().SetJournaling(false);
+        }
+    }
+
+    void NewGames(uint64_t seed, size_t threads_count = 1) {
+        ForEachGame(threads_count, [&](size_t game) {
+            games_[game].NewGame(width_, height_, mines_count_, seed + game);
+        });
+    }
+
+    // The moves of each game are made in the order they are given, and different games are played
+    // in parallel. No move is made if any of them is for a game that is not in the batch.
+    bool MakeMoves(std::span<const Move> moves, size_t threads_count = 1) {
+        if (std::any_of(moves.begin(), moves.end(), [&](const Move& move) { return move.game >= games_.size(); })) {
+            return false;
+        }
+
+        // Moves are sorted by game with a counting sort: moves of game i end up between
+        // moves_offsets_[i] and moves_offsets_[i + 1].
+        moves_offsets_.assign(games_.size() + 2, 0);
+
+        for (const auto& move : moves) {
+            ++moves_offsets_[move.game + 2];
+        }
+
+        for (size_t i = 2; i < moves_offsets_.size(); ++i) {
+            moves_offsets_[i] += moves_offsets_[i - 1];
+        }
+
+        sorted_moves_.resize(moves.size());
+
+        for (const auto& move : moves) {
+            sorted_moves_[moves_offsets_[move.game + 1]++] = move;
+        }
+
+        ForEachGame(threads_count, [&](size_t game) {
+            for (size_t i = moves_offsets_[game]; i < moves_offsets_[game + 1]; ++i) {
+                if (sorted_moves_[i].type == MoveType::OPEN) {
+                    games_[game].OpenCell(sorted_moves_[i].cell);
+                } else {
+                    games_[game].MarkCell(sorted_moves_[i].cell);
+                }
+            }
+        });
+
+        return true;
+    }
+
+    size_t GetGamesCount() const {
+        return games_.size();
+    }
+
+    const Minesweeper& GetGame(size_t game) const {
+        return games_[game];
+    }
+
+private:
+    static constexpr size_t GAMES_PER_TASK = 64;
+
+    // Threads that play along with the calling one. They are started when a round first needs them
+    // and then wait for the next round, so that rounds of moves do not start threads.
+    class WorkerPool {
+    public:
+        ~WorkerPool() {
+            {
+                std::lock_guard lock(mutex_);
+                stopping_ = true;
+            }
+
+            round_started_.notify_all();
+        }
+
+        // Runs task() on the calling thread and on workers_count workers, and returns once all of
+        // them are done.
+        template <typename Task>
+        void Run(size_t workers_count, Task& task) {
+            while (workers_.size() < workers_count) {
+                workers_.emplace_back([this, worker = workers_.size(), round = round_] { Work(worker, round); });
+            }
+
+            {
+                std::lock_guard lock(mutex_);
+                task_ = &task;
+                run_task_ = [](void* task) { (*static_cast<Task*>(task))(); };
+                active_workers_count_ = workers_count;
+                busy_workers_count_ = workers_count;
+                ++round_;
+            }
+
+            round_started_.notify_all();
+            task();
+
+            std::unique_lock lock(mutex_);
+            round_finished_.wait(lock, [this] { return busy_workers_count_ == 0; });
+        }
+
+    private:
+        void Work(size_t worker, uint64_t round) {
+            std::unique_lock lock(mutex_);
+
+            while (true) {
+                round_started_.wait(lock, [&] { return stopping_ || round_ != round; });
+
+                if (stopping_) {
+                    return;
+                }
+
+                round = round_;
+
+                if (worker >= active_workers_count_) {
+                    continue;
+                }
+
+                lock.unlock();
+                run_task_(task_);
+                lock.lock();
+
+                if (--busy_workers_count_ == 0) {
+                    round_finished_.notify_one();
+                }
+            }
+        }
+
+        std::mutex mutex_;
+        std::condition_variable round_started_;
+        std::condition_variable round_finished_;
+        void* task_ = nullptr;
+        void (*run_task_)(void*) = nullptr;
+        uint64_t round_ = 0;
+        size_t active_workers_count_ = 0;
+        size_t busy_workers_count_ = 0;
+        bool stopping_ = false;
+        // Last, so that the workers are joined before the state they wait on is destroyed.
+        std::vector<std::jthread> workers_;
+    };
+
+    // Threads take tasks of GAMES_PER_TASK games from a shared counter until there are none left, so
+    // that threads that are done with cheap games help with the rest.
+    template <typename Callback>
+    void ForEachGame(size_t threads_count, Callback&& callback) {
+        std::atomic<size_t> next_game = 0;
+
+        auto play = [&]() {
+            for (size_t first = next_game.fetch_add(GAMES_PER_TASK); first < games_.size();
+                 first = next_game.fetch_add(GAMES_PER_TASK)) {
+                for (size_t game = first; game < std::min(first + GAMES_PER_TASK, games_.size()); ++game) {
+                    callback(game);
+                }
+            }
+        };
+
+        if (threads_count <= 1) {
+            play();
+            return;
+        }
+
+        if (!workers_) {
+            workers_ = std::make_unique<WorkerPool>();
+        }
+
+        workers_->Run(threads_count - 1, play);
+    }
+
+    size_t width_;
+    size_t height_;
+    size_t mines_count_;
+    std::vector<Minesweeper> games_;
+    std::vector<size_t> moves_offsets_;
+    std::vector<Move> sorted_moves_;
+    std::unique_ptr<WorkerPool> workers_;
+};
+
+// Minesweeper with a size fixed at compile time, for the standard fields that solvers play a lot
+// of. Mines, opened and flagged cells are bitboards with a row per word, so that near mines are
+// counted and empty areas are opened a whole row at a time with shifts and masks. The loops over
+// rows are simple enough for the compiler to vectorize them, with AVX2 when it is enabled.
+template <size_t WIDTH, size_t HEIGHT>
+class BitboardMinesweeper {
+    static_assert(WIDTH >= 1 && WIDTH <= 64 && HEIGHT >= 1);
+
+public:
+    using Cell = Minesweeper::Cell;
+    using GameStatus = Minesweeper::GameStatus;
+    using RenderedField = Minesweeper::RenderedField;
+
+    // Mines are placed in the same cells as by Minesweeper with the same seed.
+    explicit BitboardMinesweeper(size_t mines_count, uint64_t seed = std::random_device()()) {
+        NewGame(mines_count, seed);
+    }
+
+    explicit BitboardMinesweeper(const std::vector<Cell>& cells_with_mines) {
+        NewGame(cells_with_mines);
+    }
+
+    void NewGame(size_t mines_count, uint64_t seed = std::random_device()()) {
+        Restart();
+        seed_ = seed;
+        PlaceRandomMines(seed, WIDTH * HEIGHT, mines_count, [this](size_t number) {
+            Cell cell = {number % WIDTH, number / WIDTH};
+
+            if (IsSet(mines_, cell)) {
+                return false;
+            }
+
+            Set(mines_, cell);
+
+            return true;
+        });
+
+        mines_count_ = Count(mines_);
+        CountNearMines();
+    }
+
+    void NewGame(const std::vector<Cell>& cells_with_mines) {
+        Restart();
+
+        for (const auto& cell : cells_with_mines) {
+            Set(mines_, cell);
+        }
+
+        mines_count_ = Count(mines_);
+        CountNearMines();
+    }
+
+    // Returns the number of cells opened by the move.
+    size_t OpenCell(const Cell& cell) {
+        size_t opened_cells_count = 0;
+
+        if (game_status_ == GameStatus::NOT_STARTED) {
+            game_status_ = GameStatus::IN_PROGRESS;
+            time(&game_time_);
+        }
+
+        if (game_status_ == GameStatus::IN_PROGRESS) {
+            if (IsSet(mines_, cell)) {
+                for (size_t y = 0; y < HEIGHT; ++y) {
+                    opened_cells_count += std::popcount(~opened_[y] & ROW_MASK);
+                    opened_[y] = ROW_MASK;
+                }
+
+                game_status_ = GameStatus::DEFEAT;
+                game_time_ = static_cast<time_t>(difftime(time(nullptr), game_time_));
+            } else {
+                if (IsSet(opened_, cell)) {
+                    return 0;
+                }
+
+                flagged_[cell.y] &= ~(uint64_t{1} << cell.x);
+                Set(opened_, cell);
+                opened_cells_count = 1 + Infect(cell);
+                opened_cell_number_ += opened_cells_count;
+
+                if (GetSafeCellsLeftCount() == 0) {
+                    game_status_ = GameStatus::VICTORY;
+                    game_time_ = static_cast<time_t>(difftime(std::time(nullptr), game_time_));
+                }
+            }
+        }
+
+        return opened_cells_count;
+    }
+
+    void MarkCell(const Cell& cell) {
+        if (game_status_ == GameStatus::NOT_STARTED) {
+            game_status_ = GameStatus::IN_PROGRESS;
+            time(&game_time_);
+        }
+
+        if (game_status_ == GameStatus::IN_PROGRESS && !IsSet(opened_, cell)) {
+            flagged_[cell.y] ^= uint64_t{1} << cell.x;
+        }
+    }
+
+    uint64_t GetSeed() const {
+        return seed_;
+    }
+
+    size_t GetMinesCount() const {
+        return mines_count_;
+    }
+
+    // Counted from the bitboard, which is a word per row.
+    size_t GetFlagsCount() const {
+        return Count(flagged_);
+    }
+
+    size_t GetSafeCellsLeftCount() const {
+        return WIDTH * HEIGHT - mines_count_ - opened_cell_number_;
+    }
+
+    GameStatus GetGameStatus() const {
+        return game_status_;
+    }
+
+    time_t GetGameTime() const {
+        return Minesweeper::GetGameTime(game_status_, game_time_);
+    }
+
+    RenderedField RenderField() const {
+        std::vector<std::string> snapshot(HEIGHT, std::string(WIDTH, '-'));
+
+        for (size_t y = 0; y < HEIGHT; ++y) {
+            for (size_t x = 0; x < WIDTH; ++x) {
+                snapshot[y][x] = RenderCell({x, y});
+            }
+        }
+
+        return snapshot;
+    }
+
+    char RenderCell(const Cell& cell) const {
+        if (IsSet(flagged_, cell)) {
+            return '?';
+        }
+
+        if (!IsSet(opened_, cell)) {
+            return '-';
+        }
+
+        if (IsSet(mines_, cell)) {
+            return '*';
+        }
+
+        size_t number_of_mines = 0;
+
+        for (size_t bit = 0; bit < near_mines_.size(); ++bit) {
+            number_of_mines |= static_cast<size_t>(IsSet(near_mines_[bit], cell)) << bit;
+        }
+
+        return number_of_mines == 0 ? '.' : static_cast<char>('0' + number_of_mines);
+    }
+
+private:
+    using Bitboard = std::array<uint64_t, HEIGHT>;
+
+    static constexpr uint64_t ROW_MASK = WIDTH == 64 ? UINT64_MAX : (uint64_t{1} << WIDTH) - 1;
+
+    static bool IsSet(const Bitboard& bitboard, const Cell& cell) {
+        return (bitboard[cell.y] >> cell.x) & 1;
+    }
+
+    static void Set(Bitboard& bitboard, const Cell& cell) {
+        bitboard[cell.y] |= uint64_t{1} << cell.x;
+    }
+
+    static size_t Count(const Bitboard& bitboard) {
+        size_t count = 0;
+
+        for (uint64_t row : bitboard) {
+            count += std::popcount(row);
+        }
+
+        return count;
+    }
+
+    // Cells in or next to a cell of the bitboard.
+    static Bitboard Dilate(const Bitboard& bitboard) {
+        Bitboard rows;
+        Bitboard result;
+
+        for (size_t y = 0; y < HEIGHT; ++y) {
+            rows[y] = bitboard[y] | (bitboard[y] << 1) | (bitboard[y] >> 1);
+        }
+
+        for (size_t y = 0; y < HEIGHT; ++y) {
+            result[y] = (rows[y] | (y > 0 ? rows[y - 1] : 0) | (y + 1 < HEIGHT ? rows[y + 1] : 0)) & ROW_MASK;
+        }
+
+        return result;
+    }
+
+    // Counts the near mines of all cells at once: the eight shifted copies of the mines are added
+    // up in binary, one bitboard per bit of the count.
+    void CountNearMines() {
+        near_mines_ = {};
+
+        auto add = [this](size_t y, uint64_t row) {
+            uint64_t carry = row & ROW_MASK;
+
+            for (auto& bits : near_mines_) {
+                uint64_t next_carry = bits[y] & carry;
+                bits[y] ^= carry;
+                carry = next_carry;
+            }
+        };
+
+        for (size_t y = 0; y < HEIGHT; ++y) {
+            add(y, mines_[y] << 1);
+            add(y, mines_[y] >> 1);
+
+            for (size_t near_y : {y - 1, y + 1}) {
+                if (near_y < HEIGHT) {
+                    add(y, mines_[near_y]);
+                    add(y, mines_[near_y] << 1);
+                    add(y, mines_[near_y] >> 1);
+                }
+            }
+        }
+
+        for (size_t y = 0; y < HEIGHT; ++y) {
+            without_near_mines_[y] = ~(near_mines_[0][y] | near_mines_[1][y] | near_mines_[2][y] | near_mines_[3][y]) &
+                                     ~mines_[y] & ROW_MASK;
+        }
+    }
+
+    // Opens the near cells of the just opened cell as long as they have no mines in their near
+    // cells, as Minesweeper does, but a ring of the area at a time. Returns the number of cells
+    // it opened.
+    size_t Infect(const Cell& cell) {
+        Bitboard opened_last = {};
+        Set(opened_last, cell);
+        size_t opened_cells_count = 0;
+
+        while (true) {
+            for (size_t y = 0; y < HEIGHT; ++y) {
+                opened_last[y] &= without_near_mines_[y];
+            }
+
+            opened_last = Dilate(opened_last);
+            uint64_t any_opened = 0;
+
+            for (size_t y = 0; y < HEIGHT; ++y) {
+                opened_last[y] &= ~opened_[y] & ~flagged_[y];
+                opened_[y] |= opened_last[y];
+                any_opened |= opened_last[y];
+                opened_cells_count += std::popcount(opened_last[y]);
+            }
+
+            if (any_opened == 0) {
+                return opened_cells_count;
+            }
+        }
+    }
+
+    void Restart() {
+        game_status_ = GameStatus::NOT_STARTED;
+        opened_cell_number_ = 0;
+        mines_count_ = 0;
+        seed_ = 0;
+        mines_ = {};
+        opened_ = {};
+        flagged_ = {};
+    }
+
+    GameStatus game_status_ = GameStatus::NOT_STARTED;
+    Bitboard mines_ = {};
+    Bitboard opened_ = {};
+    Bitboard flagged_ = {};
+    // The number of near mines of every cell, a bitboard per bit.
+    std::array<Bitboard, 4> near_mines_ = {};
+    Bitboard without_near_mines_ = {};
+    time_t game_time_ = 0;
+    size_t opened_cell_number_ = 0;
+    uint64_t seed_ = 0;
+    size_t mines_count_ = 0;
+};
+
+using BeginnerMinesweeper = BitboardMinesweeper<9, 9>;
+using IntermediateMinesweeper = BitboardMinesweeper<16, 16>;
+using ExpertMinesweeper = BitboardMinesweeper<30, 16>;
+
+// Every member of the standard fields is compiled, so that errors in them show up without a client.
+template class BitboardMinesweeper<9, 9>;
+template class BitboardMinesweeper<16, 16>;
+template class BitboardMinesweeper<30, 16>;
+
+// Follows a game through its log of changes and finds the closed cells that are certainly safe or
+// certainly have mines, as far as that follows from the numbers of opened cells one at a time. An
+// update takes time proportional to the cells opened since the previous one, not to the field.
+class MinesweeperSolver {
+public:
+    using Cell = Minesweeper::Cell;
+
+    struct MineProbabilities {
+        // Closed cells of unknown state next to the frontier, and the probabilities of mines in them.
+        std::vector<Cell> cells;
+        std::vector<double> probabilities;
+        // The probability of a mine in any other closed cell of unknown state.
+        double other_cells_probability = 0.0;
+    };
+
+    // The solver does not keep a reference to the game. It starts over by itself once the game starts
+    // a new generation of its log of changes, as after a new game or a move taken back.
+    explicit MinesweeperSolver(const Minesweeper& game) {
+        Reset(game);
+    }
+
+    void Reset(const Minesweeper& game) {
+        grid_ = FramedGrid(game.GetWidth(), game.GetHeight());
+        mines_count_ = game.GetMinesCount();
+        version_ = game.GetVersion();
+        generation_ = game.GetGeneration();
+        unknown_cells_count_ = grid_.GetWidth() * grid_.GetHeight();
+        grid_.Fill(states_, BORDER, UNKNOWN);
+        numbers_.assign(states_.size(), 0);
+        closed_near_cells_.assign(states_.size(), 0);
+        frontier_positions_.assign(states_.size(), NPOS);
+        frontier_.clear();
+        safe_cells_.clear();
+        mine_cells_.clear();
+        pending_.clear();
+
+        // The opened cells are read from the field, since the log of changes may not go back to
+        // the start of the game, as after a loaded state.
+        for (size_t y = 0; y < grid_.GetHeight(); ++y) {
+            for (size_t x = 0; x < grid_.GetWidth(); ++x) {
+                if (std::optional<size_t> number = game.GetNearMinesCount({x, y})) {
+                    Open(grid_.GetIndex({x, y}), *number);
+                }
+            }
+        }
+
+        Update(game);
+    }
+
+    // Takes in the cells opened in the game since the previous update.
+    void Update(const Minesweeper& game) {
+        if (game.GetGeneration() != generation_) {
+            Reset(game);
+            return;
+        }
+
+        for (const auto& cell : game.GetChangedCells(version_)) {
+            if (std::optional<size_t> number = game.GetNearMinesCount(cell)) {
+                Open(grid_.GetIndex(cell), *number);
+            }
+        }
+
+        version_ = game.GetVersion();
+        Deduce();
+        std::erase_if(safe_cells_, [this](const Cell& cell) { return states_[grid_.GetIndex(cell)] == OPENED; });
+    }
+
+    // Opened cells that have closed near cells. Cells without near mines are among them only while
+    // a flag keeps a near cell closed.
+    std::span<const Cell> GetFrontier() const {
+        return frontier_;
+    }
+
+    // Closed cells that certainly have no mine.
+    std::span<const Cell> GetSafeCells() const {
+        return safe_cells_;
+    }
+
+    // Cells that certainly have a mine.
+    std::span<const Cell> GetMines() const {
+        return mine_cells_;
+    }
+
+    // Probabilities of mines, given the numbers of all opened cells and the number of mines, with
+    // every placement of the mines that agrees with them equally likely. The closed cells next to
+    // the frontier are split into components that do not share numbers, placements are enumerated
+    // for each component and combined by their numbers of mines. Nothing is returned when a
+    // component has more than max_component_size cells or the numbers disagree with each other.
+    std::optional<MineProbabilities> GetMineProbabilities(size_t max_component_size = 24) const {
+        // Cells next to the frontier get local numbers, and numbers become constraints on them.
+        std::unordered_map<size_t, size_t> local_cells;
+        std::vector<size_t> cells;
+        std::vector<Constraint> constraints;
+
+        for (const auto& frontier_cell : frontier_) {
+            size_t index = grid_.GetIndex(frontier_cell);
+            Constraint constraint = {.mines_count = numbers_[index], .cells = {}};
+
+            for (ptrdiff_t offset : grid_.GetNearCellOffsets()) {
+                size_t near_index = index + static_cast<size_t>(offset);
+
+                if (states_[near_index] == MINE) {
+                    --constraint.mines_count;
+                } else if (states_[near_index] == UNKNOWN) {
+                    auto [it, inserted] = local_cells.try_emplace(near_index, cells.size());
+
+                    if (inserted) {
+                        cells.push_back(near_index);
+                    }
+
+                    constraint.cells.push_back(it->second);
+                }
+            }
+
+            if (!constraint.cells.empty()) {
+                constraints.push_back(std::move(constraint));
+            }
+        }
+
+        std::vector<Component> components = GetComponents(cells.size(), constraints);
+
+        for (auto& component : components) {
+            if (component.cells.size() > max_component_size) {
+                return std::nullopt;
+            }
+
+            CountPlacements(component, constraints);
+        }
+
+        return CombineComponents(components, cells, unknown_cells_count_ - cells.size());
+    }
+
+private:
+    enum CellState : uint8_t {
+        UNKNOWN,
+        SAFE,
+        MINE,
+        OPENED,
+        BORDER,
+    };
+
+    static constexpr size_t NPOS = static_cast<size_t>(-1);
+
+    struct Constraint {
+        int64_t mines_count = 0;
+        std::vector<size_t> cells;
+    };
+
+    struct Component {
+        std::vector<size_t> cells;
+        std::vector<size_t> constraints;
+        // The numbers of placements with k mines, in total and with a mine in each cell.
+        std::vector<double> placements;
+        std::vector<std::vector<double>> placements_with_mine;
+    };
+
+    void Open(size_t index, size_t number) {
+        if (states_[index] == OPENED) {
+            return;
+        }
+
+        if (states_[index] == UNKNOWN) {
+            --unknown_cells_count_;
+        }
+
+        states_[index] = OPENED;
+        numbers_[index] = static_cast<uint8_t>(number);
+        uint8_t closed_near_cells = 0;
+
+        for (ptrdiff_t offset : grid_.GetNearCellOffsets()) {
+            size_t near_index = index + static_cast<size_t>(offset);
+
+            if (states_[near_index] == OPENED) {
+                if (--closed_near_cells_[near_index] == 0) {
+                    RemoveFromFrontier(near_index);
+                } else if (frontier_positions_[near_index] != NPOS) {
+                    pending_.push_back(near_index);
+                }
+            } else if (states_[near_index] != BORDER) {
+                ++closed_near_cells;
+            }
+        }
+
+        closed_near_cells_[index] = closed_near_cells;
+
+        if (closed_near_cells != 0) {
+            frontier_positions_[index] = frontier_.size();
+            frontier_.push_back(grid_.GetCell(index));
+            pending_.push_back(index);
+        }
+    }
+
+    void RemoveFromFrontier(size_t index) {
+        if (frontier_positions_[index] == NPOS) {
+            return;
+        }
+
+        frontier_[frontier_positions_[index]] = frontier_.back();
+        frontier_positions_[grid_.GetIndex(frontier_.back())] = frontier_positions_[index];
+        frontier_.pop_back();
+        frontier_positions_[index] = NPOS;
+    }
+
+    // Checks the opened cells whose near cells changed: if the known mines already make up their
+    // number, the other closed near cells are safe, and if the closed near cells are just enough
+    // for it, they all have mines. Decided cells change the near cells of their neighbours in turn.
+    void Deduce() {
+        while (!pending_.empty()) {
+            size_t index = pending_.back();
+            pending_.pop_back();
+            size_t mines_count = 0;
+            size_t unknown_count = 0;
+
+            for (ptrdiff_t offset : grid_.GetNearCellOffsets()) {
+                mines_count += states_[index + static_cast<size_t>(offset)] == MINE;
+                unknown_count += states_[index + static_cast<size_t>(offset)] == UNKNOWN;
+            }
+
+            if (unknown_count == 0 ||
+                (numbers_[index] != mines_count && numbers_[index] != mines_count + unknown_count)) {
+                continue;
+            }
+
+            CellState state = numbers_[index] == mines_count ? SAFE : MINE;
+
+            for (ptrdiff_t offset : grid_.GetNearCellOffsets()) {
+                size_t near_index = index + static_cast<size_t>(offset);
+
+                if (states_[near_index] == UNKNOWN) {
+                    Decide(near_index, state);
+                }
+            }
+        }
+    }
+
+    void Decide(size_t index, CellState state) {
+        states_[index] = state;
+        --unknown_cells_count_;
+        (state == SAFE ? safe_cells_ : mine_cells_).push_back(grid_.GetCell(index));
+
+        for (ptrdiff_t offset : grid_.GetNearCellOffsets()) {
+            size_t near_index = index + static_cast<size_t>(offset);
+
+            if (frontier_positions_[near_index] != NPOS) {
+                pending_.push_back(near_index);
+            }
+        }
+    }
+
+    // Splits the cells into components connected by shared constraints, with a disjoint set forest.
+    static std::vector<Component> GetComponents(size_t cells_count, const std::vector<Constraint>& constraints) {
+        std::vector<size_t> parents(cells_count);
+
+        for (size_t i = 0; i < cells_count; ++i) {
+            parents[i] = i;
+        }
+
+        auto find_root = [&parents](size_t cell) {
+            while (parents[cell] != cell) {
+                cell = parents[cell] = parents[parents[cell]];
+            }
+
+            return cell;
+        };
+
+        for (const auto& constraint : constraints) {
+            for (size_t cell : constraint.cells) {
+                parents[find_root(cell)] = find_root(constraint.cells.front());
+            }
+        }
+
+        std::vector<Component> components;
+        std::vector<size_t> component_of_root(cells_count, NPOS);
+
+        for (size_t cell = 0; cell < cells_count; ++cell) {
+            size_t& component = component_of_root[find_root(cell)];
+
+            if (component == NPOS) {
+                component = components.size();
+                components.emplace_back();
+            }
+
+            components[component].cells.push_back(cell);
+        }
+
+        for (size_t i = 0; i < constraints.size(); ++i) {
+            components[component_of_root[find_root(constraints[i].cells.front())]].constraints.push_back(i);
+        }
+
+        return components;
+    }
+
+    // Enumerates the placements of mines in the cells of the component that satisfy its
+    // constraints, giving up on a branch as soon as a constraint can no longer be satisfied.
+    static void CountPlacements(Component& component, const std::vector<Constraint>& constraints) {
+        std::unordered_map<size_t, size_t> positions;
+
+        for (size_t i = 0; i < component.cells.size(); ++i) {
+            positions[component.cells[i]] = i;
+        }
+
+        // For every cell, the constraints on it; for every constraint, the mines still needed and
+        // its cells still free.
+        std::vector<std::vector<size_t>> cell_constraints(component.cells.size());
+        std::vector<int64_t> mines_needed;
+        std::vector<int64_t> cells_free;
+
+        for (size_t constraint : component.constraints) {
+            for (size_t cell : constraints[constraint].cells) {
+                cell_constraints[positions[cell]].push_back(mines_needed.size());
+            }
+
+            mines_needed.push_back(constraints[constraint].mines_count);
+            cells_free.push_back(static_cast<int64_t>(constraints[constraint].cells.size()));
+        }
+
+        component.placements.assign(component.cells.size() + 1, 0.0);
+        component.placements_with_mine.assign(component.cells.size(),
+                                              std::vector<double>(component.cells.size() + 1, 0.0));
+        std::vector<bool> has_mine(component.cells.size());
+        size_t mines_count = 0;
+
+        auto place = [&](auto& self, size_t cell) -> void {
+            if (cell == component.cells.size()) {
+                component.placements[mines_count] += 1.0;
+
+                for (size_t i = 0; i < has_mine.size(); ++i) {
+                    component.placements_with_mine[i][mines_count] += has_mine[i] ? 1.0 : 0.0;
+                }
+
+                return;
+            }
+
+            for (bool mine : {false, true}) {
+                bool possible = true;
+
+                for (size_t constraint : cell_constraints[cell]) {
+                    --cells_free[constraint];
+                    mines_needed[constraint] -= mine;
+                    possible = possible && mines_needed[constraint] >= 0 &&
+                               mines_needed[constraint] <= cells_free[constraint];
+                }
+
+                if (possible) {
+                    has_mine[cell] = mine;
+                    mines_count += mine;
+                    self(self, cell + 1);
+                    mines_count -= mine;
+                }
+
+                for (size_t constraint : cell_constraints[cell]) {
+                    ++cells_free[constraint];
+                    mines_needed[constraint] += mine;
+                }
+            }
+        };
+
+        place(place, 0);
+    }
+
+    static std::vector<double> Convolve(const std::vector<double>& lhs, const std::vector<double>& rhs) {
+        std::vector<double> result(lhs.size() + rhs.size() - 1, 0.0);
+
+        for (size_t i = 0; i < lhs.size(); ++i) {
+            for (size_t j = 0; j < rhs.size(); ++j) {
+                result[i + j] += lhs[i] * rhs[j];
+            }
+        }
+
+        return result;
+    }
+
+    // Weighs the placements of the components by the number of ways to place the remaining mines
+    // in the other cells.
+    std::optional<MineProbabilities> CombineComponents(const std::vector<Component>& components,
+                                                       const std::vector<size_t>& cells,
+                                                       size_t other_cells_count) const {
+        int64_t mines_left = static_cast<int64_t>(mines_count_) - static_cast<int64_t>(mine_cells_.size());
+
+        // Placements of all components before and after each one, by their numbers of mines.
+        std::vector<std::vector<double>> placements_before = {{1.0}};
+        std::vector<std::vector<double>> placements_after(components.size() + 1, {1.0});
+
+        for (const auto& component : components) {
+            placements_before.push_back(Convolve(placements_before.back(), component.placements));
+        }
+
+        for (size_t i = components.size(); i-- > 0;) {
+            placements_after[i] = Convolve(placements_after[i + 1], components[i].placements);
+        }
+
+        // Binomial coefficients of the other cells, scaled by the largest of them.
+        std::vector<double> log_weights(cells.size() + 1, -INFINITY);
+        double max_log_weight = -INFINITY;
+
+        for (size_t k = 0; k < log_weights.size(); ++k) {
+            int64_t other_mines = mines_left - static_cast<int64_t>(k);
+
+            if (other_mines >= 0 && other_mines <= static_cast<int64_t>(other_cells_count)) {
+                double others = static_cast<double>(other_cells_count);
+                double mines = static_cast<double>(other_mines);
+                log_weights[k] = std::lgamma(others + 1) - std::lgamma(mines + 1) - std::lgamma(others - mines + 1);
+                max_log_weight = std::max(max_log_weight, log_weights[k]);
+            }
+        }
+
+        std::vector<double> weights(log_weights.size());
+
+        for (size_t k = 0; k < weights.size(); ++k) {
+            weights[k] = std::exp(log_weights[k] - max_log_weight);
+        }
+
+        double total = 0.0;
+        double other_mines_total = 0.0;
+
+        for (size_t k = 0; k < weights.size(); ++k) {
+            total += placements_before.back()[k] * weights[k];
+            double other_mines = static_cast<double>(mines_left - static_cast<int64_t>(k));
+            other_mines_total += placements_before.back()[k] * weights[k] * other_mines;
+        }
+
+        if (!(total > 0.0)) {
+            return std::nullopt;
+        }
+
+        MineProbabilities result;
+        result.other_cells_probability =
+            other_cells_count == 0 ? 0.0 : other_mines_total / total / static_cast<double>(other_cells_count);
+
+        for (size_t i = 0; i < components.size(); ++i) {
+            // Weights of the numbers of mines in this component, given all the others.
+            std::vector<double> others = Convolve(placements_before[i], placements_after[i + 1]);
+            std::vector<double> component_weights(components[i].placements.size(), 0.0);
+
+            for (size_t k = 0; k < component_weights.size(); ++k) {
+                for (size_t j = 0; j < others.size() && k + j < weights.size(); ++j) {
+                    component_weights[k] += others[j] * weights[k + j];
+                }
+            }
+
+            for (size_t position = 0; position < components[i].cells.size(); ++position) {
+                double with_mine = 0.0;
+
+                for (size_t k = 0; k < component_weights.size(); ++k) {
+                    with_mine += components[i].placements_with_mine[position][k] * component_weights[k];
+                }
+
+                result.cells.push_back(grid_.GetCell(cells[components[i].cells[position]]));
+                result.probabilities.push_back(with_mine / total);
+            }
+        }
+
+        return result;
+    }
+
+    FramedGrid grid_;
+    size_t mines_count_ = 0;
+    size_t version_ = 0;
+    uint64_t generation_ = 0;
+    size_t unknown_cells_count_ = 0;
+    // What is known of every cell, laid out by grid_ with a frame of BORDER cells.
+    std::vector<CellState> states_;
+    std::vector<uint8_t> numbers_;
+    std::vector<uint8_t> closed_near_cells_;
+    std::vector<size_t> frontier_positions_;
+    std::vector<Cell> frontier_;
+    std::vector<Cell> safe_cells_;
+    std::vector<Cell> mine_cells_;
+    // Frontier cells to check for new deductions.
+    std::vector<size_t> pending_;
+};
@@ -0,0 +1,240 @@
+// Tests of the games and the solver:
+//     g++ -std=c++20 -O1 -g -fsanitize=address,undefined minesweeper_test.cpp -o minesweeper_test && ./minesweeper_test
+#include "minesweeper.cpp"
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+
+namespace {
+
+// Plays random moves in both games until they end, and checks after every move that they opened
+// as many cells and look and count the same.
+template <size_t WIDTH, size_t HEIGHT>
+void PlaySameMoves(Minesweeper& game, BitboardMinesweeper<WIDTH, HEIGHT>& bitboard_game, Xoshiro256& random) {
+    while (game.GetGameStatus() == Minesweeper::GameStatus::NOT_STARTED ||
+           game.GetGameStatus() == Minesweeper::GameStatus::IN_PROGRESS) {
+        Minesweeper::Cell cell = {random.GetBelow(WIDTH), random.GetBelow(HEIGHT)};
+
+        if (random.GetBelow(4) == 0) {
+            game.MarkCell(cell);
+            bitboard_game.MarkCell(cell);
+        } else {
+            assert(game.OpenCell(cell).size() == bitboard_game.OpenCell(cell));
+        }
+
+        assert(game.RenderField() == bitboard_game.RenderField());
+        assert(game.GetGameStatus() == bitboard_game.GetGameStatus());
+        assert(game.GetFlagsCount() == bitboard_game.GetFlagsCount());
+        assert(game.GetSafeCellsLeftCount() == bitboard_game.GetSafeCellsLeftCount());
+    }
+}
+
+// Both kinds of games have to place the mines in the same cells for a seed and play the same
+// after that.
+template <size_t WIDTH, size_t HEIGHT>
+void TestBitboardGamePlaysAsMinesweeper() {
+    Xoshiro256 random(WIDTH * HEIGHT);
+
+    for (uint64_t seed = 1; seed <= 200; ++seed) {
+        size_t mines_count = random.GetBelow(WIDTH * HEIGHT + 2);
+        Minesweeper game(WIDTH, HEIGHT, mines_count, seed);
+        BitboardMinesweeper<WIDTH, HEIGHT> bitboard_game(mines_count, seed);
+        assert(game.GetMinesCount() == bitboard_game.GetMinesCount());
+
+        // Cells are opened in order until a mine is, which shows every mine.
+        for (size_t number = 0; number < WIDTH * HEIGHT; ++number) {
+            Minesweeper::Cell cell = {number % WIDTH, number / WIDTH};
+            assert(game.OpenCell(cell).size() == bitboard_game.OpenCell(cell));
+            assert(game.RenderField() == bitboard_game.RenderField());
+        }
+
+        game.NewGame(WIDTH, HEIGHT, mines_count, seed + 1);
+        bitboard_game.NewGame(mines_count, seed + 1);
+        PlaySameMoves(game, bitboard_game, random);
+
+        std::vector<Minesweeper::Cell> cells_with_mines;
+
+        for (size_t i = random.GetBelow(WIDTH * HEIGHT / 4 + 1); i != 0; --i) {
+            cells_with_mines.push_back({random.GetBelow(WIDTH), random.GetBelow(HEIGHT)});
+        }
+
+        game.NewGame(WIDTH, HEIGHT, cells_with_mines);
+        bitboard_game.NewGame(cells_with_mines);
+        assert(game.GetMinesCount() == bitboard_game.GetMinesCount());
+        PlaySameMoves(game, bitboard_game, random);
+    }
+}
+
+// A game without a journal has to play the same, and a solver has to follow it, though every move
+// starts a new generation of its log.
+void TestGameWithoutJournalPlaysTheSame() {
+    Xoshiro256 random(2);
+
+    for (uint64_t seed = 1; seed <= 200; ++seed) {
+        Minesweeper game(9, 9, 10, seed);
+        Minesweeper unjournaled_game(9, 9, 10, seed);
+        unjournaled_game.SetJournaling(false);
+        MinesweeperSolver solver(game);
+        MinesweeperSolver unjournaled_solver(unjournaled_game);
+
+        while (game.GetGameStatus() == Minesweeper::GameStatus::NOT_STARTED ||
+               game.GetGameStatus() == Minesweeper::GameStatus::IN_PROGRESS) {
+            Minesweeper::Cell cell = {random.GetBelow(9), random.GetBelow(9)};
+
+            if (random.GetBelow(4) == 0) {
+                game.MarkCell(cell);
+                unjournaled_game.MarkCell(cell);
+            } else {
+                assert(game.OpenCell(cell).size() == unjournaled_game.OpenCell(cell).size());
+            }
+
+            solver.Update(game);
+            unjournaled_solver.Update(unjournaled_game);
+
+            assert(game.RenderField() == unjournaled_game.RenderField());
+            assert(game.GetFlagsCount() == unjournaled_game.GetFlagsCount());
+            assert(solver.GetSafeCells().size() == unjournaled_solver.GetSafeCells().size());
+            assert(solver.GetMines().size() == unjournaled_solver.GetMines().size());
+            assert(!unjournaled_game.Undo());
+        }
+    }
+}
+
+// Probabilities of mines in every cell by brute force: every placement of the mines in the closed
+// cells that agrees with the numbers of the opened cells is counted.
+std::vector<std::vector<double>> GetExhaustiveProbabilities(const Minesweeper& game) {
+    size_t width = game.GetWidth();
+    size_t height = game.GetHeight();
+    std::vector<Minesweeper::Cell> closed_cells;
+
+    for (size_t y = 0; y < height; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            if (!game.GetNearMinesCount({x, y})) {
+                closed_cells.push_back({x, y});
+            }
+        }
+    }
+
+    std::vector<std::vector<bool>> mines(height, std::vector<bool>(width, false));
+    std::vector<std::vector<double>> mine_placements(height, std::vector<double>(width, 0.0));
+    double placements = 0.0;
+
+    auto agrees = [&] {
+        for (size_t y = 0; y < height; ++y) {
+            for (size_t x = 0; x < width; ++x) {
+                std::optional<size_t> number = game.GetNearMinesCount({x, y});
+
+                if (!number) {
+                    continue;
+                }
+
+                size_t near_mines_count = 0;
+
+                for (size_t near_y = y - 1; near_y != y + 2; ++near_y) {
+                    for (size_t near_x = x - 1; near_x != x + 2; ++near_x) {
+                        if (near_y < height && near_x < width && mines[near_y][near_x]) {
+                            ++near_mines_count;
+                        }
+                    }
+                }
+
+                if (*number != near_mines_count) {
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    };
+
+    auto place = [&](auto& self, size_t first, size_t mines_left) -> void {
+        if (mines_left == 0) {
+            if (agrees()) {
+                placements += 1.0;
+
+                for (const auto& cell : closed_cells) {
+                    mine_placements[cell.y][cell.x] += mines[cell.y][cell.x] ? 1.0 : 0.0;
+                }
+            }
+
+            return;
+        }
+
+        for (size_t i = first; i + mines_left <= closed_cells.size(); ++i) {
+            mines[closed_cells[i].y][closed_cells[i].x] = true;
+            self(self, i + 1, mines_left - 1);
+            mines[closed_cells[i].y][closed_cells[i].x] = false;
+        }
+    };
+
+    place(place, 0, game.GetMinesCount());
+
+    for (auto& row : mine_placements) {
+        for (double& probability : row) {
+            probability /= placements;
+        }
+    }
+
+    return mine_placements;
+}
+
+// The solver has to find the probabilities that counting every placement of the mines gives, on
+// fields small enough to count them, after every move of random games.
+void TestSolverProbabilitiesMatchExhaustiveCounting() {
+    Xoshiro256 random(1);
+
+    for (uint64_t seed = 1; seed <= 300; ++seed) {
+        size_t width = 3 + random.GetBelow(3);
+        size_t height = 3 + random.GetBelow(2);
+        Minesweeper game(width, height, 2 + random.GetBelow(5), seed);
+        MinesweeperSolver solver(game);
+
+        while (true) {
+            game.OpenCell({random.GetBelow(width), random.GetBelow(height)});
+
+            if (game.GetGameStatus() != Minesweeper::GameStatus::IN_PROGRESS) {
+                break;
+            }
+
+            solver.Update(game);
+            std::optional<MinesweeperSolver::MineProbabilities> probabilities = solver.GetMineProbabilities();
+            assert(probabilities);
+            std::vector<std::vector<double>> expected = GetExhaustiveProbabilities(game);
+            // Closed cells the solver knows nothing of have the probability of the other cells.
+            double other_cells_probability = probabilities->other_cells_probability;
+            std::vector<std::vector<double>> found(height, std::vector<double>(width, other_cells_probability));
+
+            for (size_t i = 0; i < probabilities->cells.size(); ++i) {
+                found[probabilities->cells[i].y][probabilities->cells[i].x] = probabilities->probabilities[i];
+            }
+
+            for (const auto& cell : solver.GetSafeCells()) {
+                found[cell.y][cell.x] = 0.0;
+            }
+
+            for (const auto& cell : solver.GetMines()) {
+                found[cell.y][cell.x] = 1.0;
+            }
+
+            for (size_t y = 0; y < height; ++y) {
+                for (size_t x = 0; x < width; ++x) {
+                    assert(game.GetNearMinesCount({x, y}) || std::abs(found[y][x] - expected[y][x]) < 1e-9);
+                }
+            }
+        }
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestBitboardGamePlaysAsMinesweeper<9, 9>();
+    TestBitboardGamePlaysAsMinesweeper<16, 16>();
+    TestBitboardGamePlaysAsMinesweeper<30, 16>();
+    TestBitboardGamePlaysAsMinesweeper<64, 3>();
+    TestGameWithoutJournalPlaysTheSame();
+    TestSolverProbabilitiesMatchExhaustiveCounting();
+
+    std::cout << "OK\n";
+}
@@ -1,213 +1,2562 @@
 #include <algorithm>
-#include <cctype>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
 #include <cmath>
-#include <set>
+#include <concepts>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <istream>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
 #include <vector>
-#include <map>
 #include <unordered_map>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 const long double ERROR = 1e-9;
 
-struct Comp {
-    bool operator()(const std::string_view& lhs, const std::string_view& rhs) const {
-        for (size_t i = 0; i < lhs.size() && i < rhs.size(); ++i) {
-            if (std::tolower(lhs[i]) < std::tolower(rhs[i])) {
-                return true;
+// Query statistics are collected only when the engine is compiled with SEARCH_ENGINE_STATS, so
+// that they cost nothing otherwise.
+#ifdef SEARCH_ENGINE_STATS
+inline constexpr bool QUERY_STATS_ENABLED = true;
+#else
+inline constexpr bool QUERY_STATS_ENABLED = false;
+#endif
+
+// Case folding works on eight bytes at a time: ASCII letters are lowercased in place and all other
+// bytes are kept as they are, which matches std::tolower in the "C" locale.
+struct AsciiCase {
+    // Reads the first min(size, 8) bytes zero-extended, using fixed-size loads that overlap on short tails.
+    static uint64_t Load(const char* data, size_t size) {
+        if (size >= 8) {
+            return LoadFixed<uint64_t>(data);
+        }
+
+        if (size >= 4) {
+            return LoadFixed<uint32_t>(data) | (LoadFixed<uint32_t>(data + size - 4) << (8 * (size - 4)));
+        }
+
+        if (size == 0) {
+            return 0;
+        }
+
+        return LoadFixed<uint8_t>(data) | (LoadFixed<uint8_t>(data + size / 2) << (8 * (size / 2))) |
+               (LoadFixed<uint8_t>(data + size - 1) << (8 * (size - 1)));
+    }
+
+    static uint64_t ToLower(uint64_t bytes) {
+        constexpr uint64_t ONES = 0x0101010101010101ull;
+        uint64_t low_bits = bytes & (0x7f * ONES);
+        uint64_t is_at_least_a = low_bits + (0x80 - 'A') * ONES;
+        uint64_t is_above_z = low_bits + (0x80 - 'Z' - 1) * ONES;
+
+        return bytes | (((is_at_least_a ^ is_above_z) & ~bytes & (0x80 * ONES)) >> 2);
+    }
+
+private:
+    template <typename T>
+    static uint64_t LoadFixed(const char* data) {
+        T value;
+        std::memcpy(&value, data, sizeof(value));
+
+        return value;
+    }
+};
+
+struct CaseInsensitiveHash {
+    size_t operator()(const std::string_view& word) const {
+        uint64_t hash = word.size() * 0x9e3779b97f4a7c15ull;
+
+        for (size_t i = 0; i < word.size(); i += 8) {
+            uint64_t block = AsciiCase::ToLower(AsciiCase::Load(word.data() + i, word.size() - i));
+            hash = (hash ^ block) * 0xff51afd7ed558ccdull;
+            hash ^= hash >> 32;
+        }
+
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+
+        return static_cast<size_t>(hash);
+    }
+};
+
+struct CaseInsensitiveEqual {
+    bool operator()(const std::string_view& lhs, const std::string_view& rhs) const {
+        if (lhs.size() != rhs.size()) {
+            return false;
+        }
+
+        for (size_t i = 0; i < lhs.size(); i += 8) {
+            if (AsciiCase::ToLower(AsciiCase::Load(lhs.data() + i, lhs.size() - i)) !=
+                AsciiCase::ToLower(AsciiCase::Load(rhs.data() + i, rhs.size() - i))) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+};
+
+// Bitmask of the ASCII letters among up to 64 bytes, bit i standing for data[i]. Uses AVX2 or NEON
+// when the CPU has them and a scalar loop otherwise.
+class LetterMask {
+public:
+    static uint64_t Get(const char* data, size_t size) {
+        static const Kernel KERNEL = SelectKernel();
+
+        return KERNEL(data, size);
+    }
+
+private:
+    using Kernel = uint64_t (*)(const char*, size_t);
+
+    static Kernel SelectKernel() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+        if (__builtin_cpu_supports("avx2")) {
+            return GetAvx2;
+        }
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+        return GetNeon;
+#endif
+        return GetScalar;
+    }
+
+    static uint64_t GetScalar(const char* data, size_t size) {
+        uint64_t mask = 0;
+
+        for (size_t i = 0; i < size && i < 64; ++i) {
+            mask |= static_cast<uint64_t>(static_cast<uint8_t>((data[i] | 0x20) - 'a') < 26) << i;
+        }
+
+        return mask;
+    }
+
+    // Kernels read whole 64-byte blocks, so a shorter tail is copied to a zeroed buffer first.
+    static const char* PadBlock(const char* data, size_t size, char* buffer) {
+        if (size >= 64) {
+            return data;
+        }
+
+        std::memset(buffer, 0, 64);
+        std::memcpy(buffer, data, size);
+
+        return buffer;
+    }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    __attribute__((target("avx2"))) static uint32_t GetAvx2Half(const char* data) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+        __m256i offsets = _mm256_sub_epi8(_mm256_or_si256(bytes, _mm256_set1_epi8(0x20)), _mm256_set1_epi8('a'));
+        __m256i letters = _mm256_and_si256(_mm256_cmpgt_epi8(offsets, _mm256_set1_epi8(-1)),
+                                           _mm256_cmpgt_epi8(_mm256_set1_epi8(26), offsets));
+
+        return static_cast<uint32_t>(_mm256_movemask_epi8(letters));
+    }
+
+    __attribute__((target("avx2"))) static uint64_t GetAvx2(const char* data, size_t size) {
+        char buffer[64];
+        data = PadBlock(data, size, buffer);
+
+        return GetAvx2Half(data) | (static_cast<uint64_t>(GetAvx2Half(data + 32)) << 32);
+    }
+#endif
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+    static uint64_t GetNeon(const char* data, size_t size) {
+        static constexpr uint8_t BIT_WEIGHTS[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+        char buffer[64];
+        data = PadBlock(data, size, buffer);
+        uint64_t mask = 0;
+
+        for (size_t i = 0; i < 64; i += 16) {
+            uint8x16_t bytes = vld1q_u8(reinterpret_cast<const uint8_t*>(data + i));
+            uint8x16_t offsets = vsubq_u8(vorrq_u8(bytes, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+            uint8x16_t bits = vandq_u8(vcltq_u8(offsets, vdupq_n_u8(26)), vld1q_u8(BIT_WEIGHTS));
+            uint64_t half_mask =
+                vaddv_u8(vget_low_u8(bits)) | (static_cast<uint64_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+            mask |= half_mask << i;
+        }
+
+        return mask;
+    }
+#endif
+};
+
+// Open-addressing vocabulary that assigns dense ids to words, ignoring their case.
+class TermTable {
+public:
+    static constexpr size_t NPOS = static_cast<size_t>(-1);
+    static constexpr uint32_t EMPTY = static_cast<uint32_t>(-1);
+
+    struct Slot {
+        uint32_t hash = 0;
+        uint32_t id = EMPTY;
+    };
+
+    // Looks the word up in a table laid out by TermTable, e.g. one loaded from an index file.
+    template <typename GetTerm>
+    static size_t Find(std::span<const Slot> slots, std::string_view word, GetTerm&& get_term) {
+        if (slots.empty()) {
+            return NPOS;
+        }
+
+        uint32_t hash = static_cast<uint32_t>(CaseInsensitiveHash()(word));
+
+        for (size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+            const Slot& slot = slots[i];
+
+            if (slot.id == EMPTY) {
+                return NPOS;
+            }
+
+            if (slot.hash == hash && CaseInsensitiveEqual()(get_term(slot.id), word)) {
+                return slot.id;
+            }
+        }
+    }
+
+    void Clear() {
+        slots_.clear();
+        terms_.clear();
+    }
+
+    size_t Size() const {
+        return terms_.size();
+    }
+
+    std::string_view GetTerm(size_t id) const {
+        return terms_[id];
+    }
+
+    std::span<const Slot> GetSlots() const {
+        return slots_;
+    }
+
+    size_t Find(std::string_view word) const {
+        return Find(slots_, word, [this](size_t id) { return terms_[id]; });
+    }
+
+    // Returns the id of the word and whether it has just been added.
+    std::pair<size_t, bool> Insert(std::string_view word) {
+        if ((terms_.size() + 1) * 2 > slots_.size()) {
+            Rehash(std::max<size_t>(16, slots_.size() * 2));
+        }
+
+        uint32_t hash = static_cast<uint32_t>(CaseInsensitiveHash()(word));
+        size_t i = hash & (slots_.size() - 1);
+
+        for (; slots_[i].id != EMPTY; i = (i + 1) & (slots_.size() - 1)) {
+            if (slots_[i].hash == hash && CaseInsensitiveEqual()(terms_[slots_[i].id], word)) {
+                return {slots_[i].id, false};
+            }
+        }
+
+        slots_[i] = {.hash = hash, .id = static_cast<uint32_t>(terms_.size())};
+        terms_.push_back(word);
+
+        return {terms_.size() - 1, true};
+    }
+
+private:
+    std::vector<Slot> slots_;
+    std::vector<std::string_view> terms_;
+
+    void Rehash(size_t capacity) {
+        std::vector<Slot> slots(capacity);
+
+        for (const Slot& slot : slots_) {
+            if (slot.id == EMPTY) {
+                continue;
+            }
+
+            size_t i = slot.hash & (capacity - 1);
+
+            while (slots[i].id != EMPTY) {
+                i = (i + 1) & (capacity - 1);
+            }
+
+            slots[i] = slot;
+        }
+
+        slots_ = std::move(slots);
+    }
+};
+
+// Vector kept in fixed-size chunks that copies share until one of them is changed, so that a copy
+// costs a pointer per chunk and a change copies a single chunk. A chunk is changed in place when
+// no other copy uses it, so a copy must not be changed while it is being copied.
+template <typename T>
+class ChunkedVector {
+public:
+    ChunkedVector() = default;
+
+    ChunkedVector(size_t size, const T& value) : size_(size) {
+        for (size_t i = 0; i < size; i += CHUNK_SIZE) {
+            chunks_.push_back(std::make_shared<Chunk>());
+            chunks_.back()->fill(value);
+        }
+    }
+
+    explicit ChunkedVector(std::span<const T> values) : ChunkedVector(values.size(), T()) {
+        for (size_t i = 0; i < values.size(); i += CHUNK_SIZE) {
+            std::copy_n(values.begin() + i, std::min(CHUNK_SIZE, values.size() - i), chunks_[i / CHUNK_SIZE]->begin());
+        }
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    const T& operator[](size_t i) const {
+        return (*chunks_[i / CHUNK_SIZE])[i % CHUNK_SIZE];
+    }
+
+    T& GetMutable(size_t i) {
+        std::shared_ptr<Chunk>& chunk = chunks_[i / CHUNK_SIZE];
+
+        if (chunk.use_count() > 1) {
+            chunk = std::make_shared<Chunk>(*chunk);
+        }
+
+        return (*chunk)[i % CHUNK_SIZE];
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    using Chunk = std::array<T, CHUNK_SIZE>;
+
+    std::vector<std::shared_ptr<Chunk>> chunks_;
+    size_t size_ = 0;
+};
+
+// Read-only mapping of a whole file into memory.
+class MappedFile {
+public:
+    MappedFile() = default;
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0)) {
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            Close();
+            data_ = std::exchange(other.data_, nullptr);
+            size_ = std::exchange(other.size_, 0);
+        }
+
+        return *this;
+    }
+
+    ~MappedFile() {
+        Close();
+    }
+
+    bool Open(const std::string& path) {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY);
+
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat file_stat;
+
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            return false;
+        }
+
+        if (file_stat.st_size > 0) {
+            void* data = mmap(nullptr, static_cast<size_t>(file_stat.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+            if (data == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+
+            data_ = static_cast<const char*>(data);
+            size_ = static_cast<size_t>(file_stat.st_size);
+        }
+
+        close(fd);
+
+        return true;
+    }
+
+    void Close() {
+        if (data_ != nullptr) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+
+        data_ = nullptr;
+        size_ = 0;
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+// Owns the text that an index points into: copies kept in an arena and files mapped into memory.
+// Views of stored text stay valid until the corpus is destroyed.
+class Corpus {
+public:
+    std::string_view Store(std::string_view text) {
+        char* data = nullptr;
+
+        if (text.size() <= block_left_) {
+            data = block_;
+            block_ += text.size();
+            block_left_ -= text.size();
+        } else if (text.size() > BLOCK_SIZE / 4) {
+            data = Allocate(text.size());
+        } else {
+            block_ = Allocate(BLOCK_SIZE);
+            block_left_ = BLOCK_SIZE;
+            return Store(text);
+        }
+
+        std::copy(text.begin(), text.end(), data);
+
+        return {data, text.size()};
+    }
+
+    std::string_view Store(MappedFile file) {
+        return Store(std::make_shared<const MappedFile>(std::move(file)));
+    }
+
+    // Keeps a file that may also be used elsewhere mapped for as long as the corpus lives.
+    std::string_view Store(std::shared_ptr<const MappedFile> file) {
+        files_.push_back(std::move(file));
+
+        return {files_.back()->Data(), files_.back()->Size()};
+    }
+
+private:
+    static constexpr size_t BLOCK_SIZE = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    std::vector<std::shared_ptr<const MappedFile>> files_;
+    char* block_ = nullptr;
+    size_t block_left_ = 0;
+
+    char* Allocate(size_t size) {
+        blocks_.push_back(std::make_unique_for_overwrite<char[]>(size));
+
+        return blocks_.back().get();
+    }
+};
+
+struct Varint {
+    static void Write(std::vector<uint8_t>& out, uint64_t value) {
+        while (value >= 0x80) {
+            out.push_back(static_cast<uint8_t>(value | 0x80));
+            value >>= 7;
+        }
+
+        out.push_back(static_cast<uint8_t>(value));
+    }
+
+    // Never reads past end: a varint cut off by it is read as far as it goes.
+    static uint64_t Read(const uint8_t*& data, const uint8_t* end) {
+        uint64_t value = 0;
+
+        for (int shift = 0; data != end; shift += 7) {
+            uint8_t byte = *data++;
+
+            if (shift < 64) {
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            }
+
+            if (byte < 0x80) {
+                break;
+            }
+        }
+
+        return value;
+    }
+
+    // Number of varints in data, or std::nullopt if the last one is cut off.
+    static std::optional<size_t> Count(std::span<const uint8_t> data) {
+        if (!data.empty() && data.back() >= 0x80) {
+            return std::nullopt;
+        }
+
+        return std::count_if(data.begin(), data.end(), [](uint8_t byte) { return byte < 0x80; });
+    }
+};
+
+// A posting list is a sequence of varint pairs: the distance from the previous line of the list
+// (from zero for the first one) and the number of occurrences of the term in the line.
+class PostingListIterator {
+public:
+    explicit PostingListIterator(std::span<const uint8_t> data) : data_(data.data()), end_(data.data() + data.size()) {
+        Next();
+    }
+
+    bool IsEnd() const {
+        return is_end_;
+    }
+
+    size_t Pos() const {
+        return pos_;
+    }
+
+    uint32_t Count() const {
+        return count_;
+    }
+
+    void Next() {
+        if (data_ == end_) {
+            is_end_ = true;
+            return;
+        }
+
+        pos_ += Varint::Read(data_, end_);
+        count_ = static_cast<uint32_t>(Varint::Read(data_, end_));
+    }
+
+private:
+    const uint8_t* data_;
+    const uint8_t* end_;
+    size_t pos_ = 0;
+    uint32_t count_ = 0;
+    bool is_end_ = false;
+};
+
+// Goes through a posting list together with the word positions of its lines, if the index keeps
+// them. The positions of a term are stored as varint distances between its offsets in a line, the
+// first one counted from the start of the line, for every line of its posting list in order.
+class PositionalPostingIterator {
+public:
+    PositionalPostingIterator(std::span<const uint8_t> postings, std::span<const uint8_t> word_positions)
+        : postings_(postings),
+          word_positions_(word_positions.empty() ? nullptr : word_positions.data()),
+          word_positions_end_(word_positions.data() + word_positions.size()) {
+    }
+
+    bool IsEnd() const {
+        return postings_.IsEnd();
+    }
+
+    size_t Pos() const {
+        return postings_.Pos();
+    }
+
+    uint32_t Count() const {
+        return postings_.Count();
+    }
+
+    bool HasWordPositions() const {
+        return word_positions_ != nullptr;
+    }
+
+    // Offsets of the term among the words of the current line, in increasing order.
+    template <typename Vector>
+    void GetWordPositions(Vector& offsets) const {
+        const uint8_t* data = word_positions_;
+        uint32_t offset = 0;
+        offsets.clear();
+
+        for (uint32_t i = 0; i < Count(); ++i) {
+            offset += static_cast<uint32_t>(Varint::Read(data, word_positions_end_));
+            offsets.push_back(offset);
+        }
+    }
+
+    void Next() {
+        if (word_positions_ != nullptr && !IsEnd()) {
+            for (uint32_t i = 0; i < Count(); ++i) {
+                Varint::Read(word_positions_, word_positions_end_);
+            }
+        }
+
+        postings_.Next();
+    }
+
+private:
+    PostingListIterator postings_;
+    const uint8_t* word_positions_;
+    const uint8_t* word_positions_end_;
+};
+
+// Bounded LRU cache of search results, mapping the query terms, folded to lower case and sorted,
+// and the number of results to the positions of the ranked lines. Entries are only valid for the
+// generation of the index they were computed on, and the whole cache is dropped once a newer one
+// is used. Keys are spread by hash over shards, each an LRU with a lock of its own. A search never
+// waits for a shard: if another thread holds it, the search goes without the cache. Once a shard
+// is full, a new entry takes over the storage of the one it evicts, so a warm cache does not allocate.
+class QueryCache {
+public:
+    // The capacity is split evenly over the shards, of which there are no more than entries.
+    explicit QueryCache(size_t capacity) : shards_(std::min(capacity, SHARDS_COUNT)) {
+        for (size_t i = 0; i < shards_.size(); ++i) {
+            shards_[i].capacity = capacity / shards_.size() + (i < capacity % shards_.size() ? 1 : 0);
+        }
+    }
+
+    // Terms consist of letters, so they are told apart by the spaces after them.
+    static std::pmr::string GetKey(std::span<const std::pmr::string> terms, size_t results_count,
+                                   std::pmr::memory_resource* memory) {
+        std::pmr::string key(sizeof(size_t), '\0', memory);
+        std::memcpy(key.data(), &results_count, sizeof(size_t));
+
+        for (const auto& term : terms) {
+            key.append(term);
+            key.push_back(' ');
+        }
+
+        return key;
+    }
+
+    // Copies the cached positions, if any, to positions.
+    bool Find(std::string_view key, uint64_t generation, std::pmr::vector<size_t>& positions) {
+        Shard& shard = GetShard(key);
+        std::unique_lock lock(shard.mutex, std::try_to_lock);
+
+        if (!lock.owns_lock() || !UseGeneration(shard, generation)) {
+            return false;
+        }
+
+        auto it = shard.entries_by_key.find(key);
+
+        if (it == shard.entries_by_key.end()) {
+            return false;
+        }
+
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        positions.assign(it->second->positions.begin(), it->second->positions.end());
+
+        return true;
+    }
+
+    void Insert(std::string_view key, uint64_t generation, std::span<const size_t> positions) {
+        Shard& shard = GetShard(key);
+        std::unique_lock lock(shard.mutex, std::try_to_lock);
+
+        if (!lock.owns_lock() || !UseGeneration(shard, generation) || shard.entries_by_key.contains(key)) {
+            return;
+        }
+
+        // The least recently used entry is moved to the front and refilled, together with its node
+        // of the map, which is taken out while its key changes.
+        EntriesByKey::node_type node;
+
+        if (shard.entries.size() < shard.capacity) {
+            shard.entries.emplace_front();
+        } else {
+            shard.entries.splice(shard.entries.begin(), shard.entries, std::prev(shard.entries.end()));
+            node = shard.entries_by_key.extract(shard.entries.front().key);
+        }
+
+        Entry& entry = shard.entries.front();
+        entry.key.assign(key);
+        entry.positions.assign(positions.begin(), positions.end());
+
+        if (node) {
+            node.key() = entry.key;
+            node.mapped() = shard.entries.begin();
+            shard.entries_by_key.insert(std::move(node));
+        } else {
+            shard.entries_by_key.emplace(entry.key, shard.entries.begin());
+        }
+    }
+
+private:
+    static constexpr size_t SHARDS_COUNT = 16;
+
+    struct Entry {
+        std::string key;
+        std::vector<size_t> positions;
+    };
+
+    using EntriesByKey = std::unordered_map<std::string_view, std::list<Entry>::iterator>;
+
+    struct Shard {
+        std::mutex mutex;
+        size_t capacity = 0;
+        uint64_t generation = 0;
+        // Most recently used first.
+        std::list<Entry> entries;
+        EntriesByKey entries_by_key;
+    };
+
+    std::vector<Shard> shards_;
+
+    Shard& GetShard(std::string_view key) {
+        return shards_[std::hash<std::string_view>()(key) % shards_.size()];
+    }
+
+    // Moves the shard to a newer generation, dropping all of its entries. Searches on an older index
+    // that is still in use elsewhere bypass the cache.
+    static bool UseGeneration(Shard& shard, uint64_t generation) {
+        if (generation > shard.generation) {
+            shard.entries_by_key.clear();
+            shard.entries.clear();
+            shard.generation = generation;
+        }
+
+        return generation == shard.generation;
+    }
+};
+
+struct IndexOptions {
+    // Keeps the offsets of every word in its line, which SearchPhrase uses instead of scanning the
+    // text of candidate lines. Takes about as much memory again as the posting lists.
+    bool store_word_positions = false;
+};
+
+// Where the time of a Search goes. Counters are added to, so one instance can sum up several queries.
+struct QueryStats {
+    uint64_t postings_scanned = 0;
+    uint64_t candidates_scored = 0;
+    uint64_t heap_operations = 0;
+    uint64_t cache_hits = 0;
+    std::chrono::nanoseconds tokenization_time{0};
+    std::chrono::nanoseconds scoring_time{0};
+};
+
+struct IndexStats {
+    size_t lines_count = 0;
+    size_t removed_lines_count = 0;
+    size_t vocabulary_size = 0;
+    // Postings of live lines; removed lines stay in the posting lists until the index is saved.
+    size_t postings_count = 0;
+    size_t posting_bytes = 0;
+    size_t word_position_bytes = 0;
+    double average_postings_per_term = 0.0;
+};
+
+// Index of the lines of a text. It is not safe to modify while it is being searched; SearchEngine
+// takes care of that by publishing modified copies. Copies share the text owned by the index.
+// Text the index has copied or mapped is kept until the index and its copies are destroyed, even
+// when it is rebuilt, so found lines stay valid for as long as the index lives.
+class SearchIndex {
+public:
+    struct RelevanceAndPos {
+        double relevance = 0.0;
+        size_t pos;
+    };
+
+    explicit SearchIndex(IndexOptions options = {}) : options_(options) {
+    }
+
+    // Keeps the text it copies or maps in the corpus, which other indexes may share, so that their
+    // found lines stay valid for as long as the corpus lives.
+    SearchIndex(IndexOptions options, std::shared_ptr<Corpus> corpus) : options_(options), corpus_(std::move(corpus)) {
+    }
+
+    // The text is not copied and has to outlive the engine.
+    void BuildIndex(std::string_view text, size_t threads_count = 1) {
+        Clear();
+        AddDocument(text, threads_count);
+    }
+
+    // Maps the file instead of reading it, so that it is paged in by the kernel while indexing.
+    bool BuildIndexFromFile(const std::string& path, size_t threads_count = 1) {
+        MappedFile file;
+
+        if (!file.Open(path)) {
+            return false;
+        }
+
+        Clear();
+        AddDocument(corpus_->Store(std::move(file)), threads_count);
+
+        return true;
+    }
+
+    // Appends the lines of text to the index and returns the position of the first of them.
+    // The text is not copied and has to outlive the engine.
+    // With several threads the lines are split into shards that are indexed in parallel and
+    // merged in order, which gives the same index as a single-threaded build.
+    // The lines make up a new segment, so existing segments are not copied, apart from merges.
+    size_t AddDocument(std::string_view text, size_t threads_count = 1) {
+        generation_ = NextGeneration();
+        size_t first_pos = GetLinesCount();
+        SegmentData data;
+        data.first_pos = first_pos;
+        data.AddLines(text, threads_count, options_.store_word_positions);
+        AddSegment(std::move(data));
+
+        return first_pos;
+    }
+
+    // Same as AddDocument, but the text is copied into storage owned by the engine.
+    size_t AddDocumentCopy(std::string_view text, size_t threads_count = 1) {
+        return AddDocument(corpus_->Store(text), threads_count);
+    }
+
+    // Same as AddDocument for the contents of the file, which stays mapped while the engine lives.
+    std::optional<size_t> AddDocumentFromFile(const std::string& path, size_t threads_count = 1) {
+        MappedFile file;
+
+        if (!file.Open(path)) {
+            return std::nullopt;
+        }
+
+        return AddDocument(corpus_->Store(std::move(file)), threads_count);
+    }
+
+    // Same as AddDocument for text read in chunks by read(buffer, size), which returns the number of
+    // bytes it has put into the buffer, 0 at the end of the text or std::nullopt on an error.
+    // Complete lines of every chunk are copied into storage owned by the engine and indexed while
+    // the next chunk is being read, so that the text never has to be in memory as a whole.
+    // On an error the lines read before it stay indexed. An exception thrown by read is passed on
+    // once the reader is joined, and no line of the text is indexed then.
+    template <typename Read>
+        requires std::invocable<Read&, char*, size_t>
+    std::optional<size_t> AddDocumentFromStream(Read&& read, size_t threads_count = 1) {
+        generation_ = NextGeneration();
+        size_t first_pos = GetLinesCount();
+        // All chunks go to one segment, which is added once the text is read.
+        SegmentData data;
+        data.first_pos = first_pos;
+        std::string chunk(STREAM_CHUNK_SIZE, '\0');
+        std::string next_chunk(STREAM_CHUNK_SIZE, '\0');
+        // The beginning of a line that continues in the next chunk.
+        std::string unfinished_line;
+        std::optional<size_t> chunk_size = read(chunk.data(), chunk.size());
+
+        while (chunk_size && *chunk_size != 0) {
+            std::optional<size_t> next_chunk_size;
+            std::exception_ptr read_error;
+            // Joined on destruction too, so that an exception thrown while indexing the chunk does
+            // not leave it running.
+            std::jthread reader([&] {
+                try {
+                    next_chunk_size = read(next_chunk.data(), next_chunk.size());
+                } catch (...) {
+                    read_error = std::current_exception();
+                }
+            });
+
+            std::string_view chunk_data(chunk.data(), *chunk_size);
+            size_t lines_end = chunk_data.rfind('\n') + 1;
+
+            if (lines_end != 0) {
+                unfinished_line.append(chunk_data.substr(0, lines_end));
+                data.AddLines(corpus_->Store(unfinished_line), threads_count, options_.store_word_positions);
+                unfinished_line.clear();
+            }
+
+            unfinished_line.append(chunk_data.substr(lines_end));
+            reader.join();
+
+            if (read_error) {
+                std::rethrow_exception(read_error);
+            }
+
+            std::swap(chunk, next_chunk);
+            chunk_size = next_chunk_size;
+        }
+
+        if (!chunk_size) {
+            AddSegment(std::move(data));
+            return std::nullopt;
+        }
+
+        data.AddLines(corpus_->Store(unfinished_line), threads_count, options_.store_word_positions);
+        AddSegment(std::move(data));
+
+        return first_pos;
+    }
+
+    std::optional<size_t> AddDocumentFromStream(std::istream& input, size_t threads_count = 1) {
+        return AddDocumentFromStream(
+            [&input](char* buffer, size_t size) -> std::optional<size_t> {
+                input.read(buffer, static_cast<std::streamsize>(size));
+
+                if (input.bad()) {
+                    return std::nullopt;
+                }
+
+                return static_cast<size_t>(input.gcount());
+            },
+            threads_count);
+    }
+
+    template <typename Source>
+    bool BuildIndexFromStream(Source&& source, size_t threads_count = 1) {
+        Clear();
+
+        return AddDocumentFromStream(std::forward<Source>(source), threads_count).has_value();
+    }
+
+    // Excludes the line from search results and from document frequencies. Its postings are
+    // kept as tombstones until the next BuildIndex. A mapped segment is copied into memory the
+    // first time one of its lines is removed; later removals only copy the chunks they change.
+    void RemoveLine(size_t pos) {
+        if (pos >= GetLinesCount() || IsRemoved(pos)) {
+            return;
+        }
+
+        Segment& segment = segments_[FindSegment(pos)];
+
+        if (segment.IsMapped()) {
+            segment = segment.Materialize();
+        }
+
+        segment.RemoveLine(pos);
+        ++removed_lines_count_;
+        generation_ = NextGeneration();
+    }
+
+    size_t GetLinesCount() const {
+        return segments_.empty() ? 0 : segments_.back().GetEndPos();
+    }
+
+    IndexStats GetStats() const {
+        IndexStats stats = {.lines_count = GetLinesCount(),
+                            .removed_lines_count = removed_lines_count_,
+                            .vocabulary_size = GetVocabularySize()};
+
+        for (const Segment& segment : segments_) {
+            for (size_t term_id = 0; term_id < segment.GetTermsCount(); ++term_id) {
+                stats.postings_count += segment.GetDocumentFrequency(term_id);
+                stats.posting_bytes += segment.GetPostings(term_id).size();
+                stats.word_position_bytes += segment.GetWordPositions(term_id).size();
+            }
+        }
+
+        if (stats.vocabulary_size != 0) {
+            stats.average_postings_per_term =
+                static_cast<double>(stats.postings_count) / static_cast<double>(stats.vocabulary_size);
+        }
+
+        return stats;
+    }
+
+    // Results are looked up in and added to the cache, if one is given. Statistics of the query are
+    // added to stats, if it is given and they are enabled.
+    std::vector<std::string_view> Search(std::string_view query, size_t results_count,
+                                         QueryCache* query_cache = nullptr, QueryStats* stats = nullptr) const {
+        if (results_count == 0 || GetLinesCount() == removed_lines_count_) {
+            return {};
+        }
+
+        // Temporaries of the query are kept on the stack, unless it has a lot of terms.
+        std::array<std::byte, QUERY_ARENA_SIZE> arena_buffer;
+        std::pmr::monotonic_buffer_resource arena(arena_buffer.data(), arena_buffer.size());
+        auto start_time = GetStatsTime(stats);
+        QueryTerms terms = GetQueryTerms(query, &arena);
+        AddStatsTime(stats, &QueryStats::tokenization_time, start_time);
+        std::pmr::vector<size_t> positions(&arena);
+        std::pmr::string cache_key = query_cache != nullptr ? QueryCache::GetKey(terms.words, results_count, &arena)
+                                                            : std::pmr::string(&arena);
+
+        if (query_cache != nullptr && query_cache->Find(cache_key, generation_, positions)) {
+            AddStats(stats, &QueryStats::cache_hits, 1);
+        } else {
+            start_time = GetStatsTime(stats);
+            positions = GetTopPositions(terms, results_count, &arena, stats);
+            AddStatsTime(stats, &QueryStats::scoring_time, start_time);
+
+            if (query_cache != nullptr) {
+                query_cache->Insert(cache_key, generation_, positions);
+            }
+        }
+
+        std::vector<std::string_view> result;
+        result.reserve(positions.size());
+
+        for (size_t pos : positions) {
+            result.push_back(GetLine(pos));
+        }
+
+        return result;
+    }
+
+    // Lines where the words of the phrase occur in this order, with at most slop other words among
+    // them. They are ranked by TF-IDF of the phrase taken as a single term: its number of
+    // occurrences over the number of words in the line, times the log of the number of live lines
+    // over the number of lines where it occurs.
+    std::vector<std::string_view> SearchPhrase(std::string_view phrase, size_t results_count, size_t slop = 0) const {
+        if (results_count == 0 || GetLinesCount() == removed_lines_count_) {
+            return {};
+        }
+
+        std::array<std::byte, QUERY_ARENA_SIZE> arena_buffer;
+        std::pmr::monotonic_buffer_resource arena(arena_buffer.data(), arena_buffer.size());
+        std::pmr::vector<std::string_view> phrase_words(&arena);
+
+        ForEachWord(phrase, [&](std::string_view word) { phrase_words.push_back(word); });
+
+        if (phrase_words.empty()) {
+            return {};
+        }
+
+        std::pmr::vector<size_t> phrase_terms(&arena);
+        std::pmr::vector<size_t> terms(&arena);
+        std::pmr::vector<PositionalPostingIterator> cursors(&arena);
+        std::pmr::vector<std::pmr::vector<uint32_t>> word_positions(&arena);
+        std::pmr::vector<size_t> phrase_cursors(&arena);
+        // The number of occurrences of the phrase in a line over the number of words in it.
+        std::pmr::vector<RelevanceAndPos> occurrences(&arena);
+
+        // Every line of the phrase is in a segment that has all of its words, and there in the
+        // posting lists of all of its terms, which are intersected by moving all cursors to the
+        // furthest one.
+        for (const Segment& segment : segments_) {
+            phrase_terms.clear();
+
+            for (std::string_view word : phrase_words) {
+                if (size_t term_id = segment.FindTerm(word); term_id != TermTable::NPOS) {
+                    phrase_terms.push_back(term_id);
+                }
+            }
+
+            if (phrase_terms.size() != phrase_words.size()) {
+                continue;
+            }
+
+            terms.assign(phrase_terms.begin(), phrase_terms.end());
+            std::sort(terms.begin(), terms.end());
+            terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+            cursors.clear();
+            word_positions.resize(terms.size());
+            phrase_cursors.clear();
+
+            for (size_t term_id : terms) {
+                cursors.emplace_back(segment.GetPostings(term_id), segment.GetWordPositions(term_id));
+            }
+
+            for (size_t term_id : phrase_terms) {
+                phrase_cursors.push_back(std::lower_bound(terms.begin(), terms.end(), term_id) - terms.begin());
+            }
+
+            for (size_t pos = segment.GetFirstPos();; ++pos) {
+                for (size_t i = 0; i < cursors.size(); ++i) {
+                    while (!cursors[i].IsEnd() && cursors[i].Pos() < pos) {
+                        cursors[i].Next();
+                    }
+
+                    if (cursors[i].IsEnd()) {
+                        break;
+                    }
+
+                    if (cursors[i].Pos() > pos) {
+                        pos = cursors[i].Pos();
+                        i = static_cast<size_t>(-1);
+                    }
+                }
+
+                if (std::any_of(cursors.begin(), cursors.end(), [](const auto& cursor) { return cursor.IsEnd(); })) {
+                    break;
+                }
+
+                if (segment.IsRemoved(pos)) {
+                    continue;
+                }
+
+                GetWordPositionsInLine(segment, pos, terms, cursors, word_positions);
+
+                if (size_t count = CountPhraseOccurrences(phrase_cursors, word_positions, slop); count != 0) {
+                    double tf = static_cast<double>(count) / static_cast<double>(segment.GetLineLength(pos));
+                    occurrences.push_back({.relevance = tf, .pos = pos});
+                }
+            }
+        }
+
+        if (occurrences.empty()) {
+            return {};
+        }
+
+        double lines_count = static_cast<double>(GetLinesCount() - removed_lines_count_);
+        double idf = std::log(lines_count / static_cast<double>(occurrences.size()));
+        std::pmr::vector<RelevanceAndPos> top_lines(&arena);
+
+        for (const auto& [tf, pos] : occurrences) {
+            PushToTop(top_lines, {.relevance = tf * idf, .pos = pos}, results_count);
+        }
+
+        return GetTopLines(top_lines);
+    }
+
+    // Answers several queries at once. The posting list of every term used in the batch is decoded
+    // a single time and shared by all queries using it, and the queries are scored on threads_count
+    // threads, each reusing one set of accumulators.
+    std::vector<std::vector<std::string_view>> SearchBatch(std::span<const std::string_view> queries,
+                                                           size_t results_count, size_t threads_count = 1) const {
+        std::vector<std::vector<std::string_view>> results(queries.size());
+
+        if (results_count == 0 || queries.empty() || GetLinesCount() == removed_lines_count_) {
+            return results;
+        }
+
+        // The terms and decoded postings are kept in one arena, which is released with the batch.
+        std::pmr::monotonic_buffer_resource arena;
+        std::pmr::unordered_map<std::pmr::string, std::pmr::vector<RelevanceAndPos>> scored_postings(&arena);
+        std::pmr::vector<std::pmr::vector<const std::pmr::vector<RelevanceAndPos>*>> queries_postings(&arena);
+        queries_postings.reserve(queries.size());
+
+        for (std::string_view query : queries) {
+            QueryTerms terms = GetQueryTerms(query, &arena);
+            queries_postings.emplace_back();
+
+            for (size_t i = 0; i < terms.words.size(); ++i) {
+                auto [it, inserted] = scored_postings.try_emplace(terms.words[i]);
+                auto& postings = it->second;
+
+                if (inserted) {
+                    postings.reserve(GetDocumentFrequency(terms.GetIds(i)));
+                    ForEachScoredPosting(terms.GetIds(i), [&postings](size_t pos, double relevance) {
+                        if (relevance != 0.0) {
+                            postings.push_back({.relevance = relevance, .pos = pos});
+                        }
+                    });
+                }
+
+                queries_postings.back().push_back(&postings);
+            }
+        }
+
+        threads_count = std::clamp<size_t>(threads_count, 1, queries.size());
+
+        auto score_queries = [&](size_t first_query) {
+            std::vector<double> relevances(GetLinesCount());
+            std::vector<size_t> touched_lines;
+            std::vector<RelevanceAndPos> top_lines;
+
+            for (size_t i = first_query; i < queries.size(); i += threads_count) {
+                for (const auto* postings : queries_postings[i]) {
+                    for (const auto& posting : *postings) {
+                        if (relevances[posting.pos] == 0.0) {
+                            touched_lines.push_back(posting.pos);
+                        }
+
+                        relevances[posting.pos] += posting.relevance;
+                    }
+                }
+
+                for (size_t pos : touched_lines) {
+                    PushToTop(top_lines, {.relevance = relevances[pos], .pos = pos}, results_count);
+                    relevances[pos] = 0.0;
+                }
+
+                results[i] = GetTopLines(top_lines);
+                touched_lines.clear();
+                top_lines.clear();
+            }
+        };
+
+        std::vector<std::thread> threads;
+
+        for (size_t i = 1; i < threads_count; ++i) {
+            threads.emplace_back(score_queries, i);
+        }
+
+        score_queries(0);
+
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        return results;
+    }
+
+    // Writes the index together with the text of its lines, so that a loaded index does not need
+    // the original text. Postings and text of removed lines are dropped. The segments are merged
+    // into one first, so the file holds a single segment.
+    bool Save(const std::string& path) const {
+        if (segments_.size() > 1) {
+            return SaveSegment(MergeSegments(segments_), path);
+        }
+
+        return SaveSegment(segments_.empty() ? Segment(SegmentData()) : segments_.front(), path);
+    }
+
+    // Maps an index written by Save. Search is served straight from the mapped pages, lines added
+    // later go to segments of their own, and the mapped segment is copied into memory only when
+    // it is merged or one of its lines is removed.
+    bool Load(const std::string& path) {
+        auto mapped_index = std::make_shared<MappedIndex>();
+
+        if (!mapped_index->Open(path)) {
+            return false;
+        }
+
+        Clear();
+        options_.store_word_positions = mapped_index->header->stores_word_positions != 0;
+        corpus_->Store(mapped_index->file);
+        removed_lines_count_ = mapped_index->header->removed_lines_count;
+
+        if (mapped_index->header->lines_count != 0) {
+            segments_.emplace_back(std::move(mapped_index));
+        }
+
+        return true;
+    }
+
+private:
+    static constexpr size_t MIN_LINES_PER_SHARD = 1024;
+    static constexpr size_t QUERY_ARENA_SIZE = 4096;
+    // Results reserved up front; a query asking for more lets them grow as they are found.
+    static constexpr size_t MAX_RESERVED_RESULTS = 1024;
+    static constexpr size_t STREAM_CHUNK_SIZE = 1 << 20;
+    static constexpr size_t SEGMENT_MERGE_FACTOR = 2;
+
+    struct InvertedIndex {
+        TermTable terms;
+        std::vector<std::vector<uint8_t>> postings;
+        std::vector<std::vector<uint8_t>> word_positions;
+        std::vector<size_t> last_positions;
+        std::vector<size_t> document_frequencies;
+        std::vector<double> max_tfs;
+        std::vector<size_t> term_counts;
+        std::vector<size_t> terms_in_line;
+        // Terms of the words of the line with their offsets.
+        std::vector<std::pair<size_t, uint32_t>> words_in_line;
+
+        size_t InternTerm(std::string_view word) {
+            auto [term_id, inserted] = terms.Insert(word);
+
+            if (inserted) {
+                postings.emplace_back();
+                word_positions.emplace_back();
+                last_positions.push_back(0);
+                document_frequencies.push_back(0);
+                max_tfs.push_back(0.0);
+                term_counts.push_back(0);
+            }
+
+            return term_id;
+        }
+
+        // Returns the number of words in the line.
+        uint32_t AddLine(std::string_view line, size_t pos, bool store_word_positions) {
+            size_t words_count = 0;
+
+            ForEachWord(line, [&](std::string_view word) {
+                size_t term_id = InternTerm(word);
+
+                if (term_counts[term_id]++ == 0) {
+                    terms_in_line.push_back(term_id);
+                }
+
+                if (store_word_positions) {
+                    words_in_line.emplace_back(term_id, static_cast<uint32_t>(words_count));
+                }
+
+                ++words_count;
+            });
+
+            std::sort(words_in_line.begin(), words_in_line.end());
+
+            for (size_t i = 0; i < words_in_line.size(); ++i) {
+                auto [term_id, offset] = words_in_line[i];
+                bool continues_term = i != 0 && words_in_line[i - 1].first == term_id;
+                Varint::Write(word_positions[term_id], offset - (continues_term ? words_in_line[i - 1].second : 0));
+            }
+
+            words_in_line.clear();
+
+            for (size_t term_id : terms_in_line) {
+                Varint::Write(postings[term_id], pos - last_positions[term_id]);
+                Varint::Write(postings[term_id], term_counts[term_id]);
+                last_positions[term_id] = pos;
+                ++document_frequencies[term_id];
+                double tf = static_cast<double>(term_counts[term_id]) / static_cast<double>(words_count);
+                max_tfs[term_id] = std::max(max_tfs[term_id], tf);
+                term_counts[term_id] = 0;
+            }
+
+            terms_in_line.clear();
+
+            return static_cast<uint32_t>(words_count);
+        }
+
+        // Merges an index of the lines that follow all lines of this one, whose terms have the
+        // given document frequencies.
+        void Append(const InvertedIndex& other, std::span<const size_t> other_document_frequencies) {
+            for (size_t other_id = 0; other_id < other.terms.Size(); ++other_id) {
+                size_t term_id = InternTerm(other.terms.GetTerm(other_id));
+                const uint8_t* data = other.postings[other_id].data();
+                const uint8_t* end = data + other.postings[other_id].size();
+
+                if (data == end) {
+                    continue;
+                }
+
+                // Only the first distance of the appended list depends on this one.
+                Varint::Write(postings[term_id], Varint::Read(data, end) - last_positions[term_id]);
+                postings[term_id].insert(postings[term_id].end(), data, end);
+                word_positions[term_id].insert(word_positions[term_id].end(), other.word_positions[other_id].begin(),
+                                               other.word_positions[other_id].end());
+                last_positions[term_id] = other.last_positions[other_id];
+                document_frequencies[term_id] += other_document_frequencies[other_id];
+                max_tfs[term_id] = std::max(max_tfs[term_id], other.max_tfs[other_id]);
+            }
+        }
+    };
+
+    static constexpr char INDEX_FILE_MAGIC[8] = {'S', 'R', 'C', 'H', 'I', 'D', 'X', '\0'};
+    static constexpr uint64_t INDEX_FILE_VERSION = 6;
+
+    struct IndexFileHeader {
+        char magic[8] = {};
+        uint64_t version = INDEX_FILE_VERSION;
+        uint64_t lines_count = 0;
+        uint64_t terms_count = 0;
+        uint64_t slots_count = 0;
+        uint64_t postings_size = 0;
+        uint64_t removed_lines_count = 0;
+        uint64_t text_size = 0;
+        uint64_t terms_text_size = 0;
+        uint64_t word_positions_size = 0;
+        uint64_t stores_word_positions = 0;
+    };
+
+    // Offsets of the sections that follow the header in an index file, each aligned to 8 bytes.
+    struct IndexFileLayout {
+        size_t line_offsets;
+        size_t line_lengths;
+        size_t term_offsets;
+        size_t slots;
+        size_t posting_offsets;
+        size_t postings;
+        size_t word_position_offsets;
+        size_t word_positions;
+        size_t document_frequencies;
+        size_t max_tfs;
+        size_t removed_lines;
+        size_t text;
+        size_t terms_text;
+        size_t size;
+
+        explicit IndexFileLayout(const IndexFileHeader& header) {
+            size_t offset = sizeof(IndexFileHeader);
+
+            auto section = [&offset](size_t size) {
+                size_t begin = offset;
+                offset = (offset + size + 7) / 8 * 8;
+                return begin;
+            };
+
+            line_offsets = section((header.lines_count + 1) * sizeof(uint64_t));
+            line_lengths = section(header.lines_count * sizeof(uint32_t));
+            term_offsets = section((header.terms_count + 1) * sizeof(uint64_t));
+            slots = section(header.slots_count * sizeof(TermTable::Slot));
+            posting_offsets = section((header.terms_count + 1) * sizeof(uint64_t));
+            postings = section(header.postings_size);
+            word_position_offsets = section((header.terms_count + 1) * sizeof(uint64_t));
+            word_positions = section(header.word_positions_size);
+            document_frequencies = section(header.terms_count * sizeof(uint64_t));
+            max_tfs = section(header.terms_count * sizeof(double));
+            removed_lines = section(GetBitsetSize(header.lines_count) * sizeof(uint64_t));
+            text = section(header.text_size);
+            terms_text = section(header.terms_text_size);
+            size = offset;
+        }
+    };
+
+    struct MappedIndex {
+        std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+        const IndexFileHeader* header = nullptr;
+        std::span<const uint64_t> line_offsets;
+        std::span<const uint32_t> line_lengths;
+        std::span<const uint64_t> term_offsets;
+        std::span<const TermTable::Slot> slots;
+        std::span<const uint64_t> posting_offsets;
+        std::span<const uint8_t> postings;
+        std::span<const uint64_t> word_position_offsets;
+        std::span<const uint8_t> word_positions;
+        std::span<const uint64_t> document_frequencies;
+        std::span<const double> max_tfs;
+        // A bitset with bit pos set for every removed line.
+        std::span<const uint64_t> removed_lines;
+        const char* text = nullptr;
+        const char* terms_text = nullptr;
+
+        bool Open(const std::string& path) {
+            if (!file->Open(path) || file->Size() < sizeof(IndexFileHeader)) {
+                return false;
+            }
+
+            header = reinterpret_cast<const IndexFileHeader*>(file->Data());
+
+            if (!std::equal(std::begin(INDEX_FILE_MAGIC), std::end(INDEX_FILE_MAGIC), header->magic) ||
+                header->version != INDEX_FILE_VERSION) {
+                return false;
+            }
+
+            // Each element of a section takes at least a byte, which also keeps the layout from overflowing.
+            for (uint64_t size : {header->lines_count, header->terms_count, header->slots_count, header->postings_size,
+                                  header->text_size, header->terms_text_size, header->word_positions_size}) {
+                if (size > file->Size()) {
+                    return false;
+                }
+            }
+
+            IndexFileLayout layout(*header);
+
+            if (file->Size() < layout.size || (header->slots_count & (header->slots_count - 1)) != 0) {
+                return false;
+            }
+
+            line_offsets = Section<uint64_t>(layout.line_offsets, header->lines_count + 1);
+            line_lengths = Section<uint32_t>(layout.line_lengths, header->lines_count);
+            term_offsets = Section<uint64_t>(layout.term_offsets, header->terms_count + 1);
+            slots = Section<TermTable::Slot>(layout.slots, header->slots_count);
+            posting_offsets = Section<uint64_t>(layout.posting_offsets, header->terms_count + 1);
+            postings = Section<uint8_t>(layout.postings, header->postings_size);
+            word_position_offsets = Section<uint64_t>(layout.word_position_offsets, header->terms_count + 1);
+            word_positions = Section<uint8_t>(layout.word_positions, header->word_positions_size);
+            document_frequencies = Section<uint64_t>(layout.document_frequencies, header->terms_count);
+            max_tfs = Section<double>(layout.max_tfs, header->terms_count);
+            removed_lines = Section<uint64_t>(layout.removed_lines, GetBitsetSize(header->lines_count));
+            text = file->Data() + layout.text;
+            terms_text = file->Data() + layout.terms_text;
+
+            return IsValid();
+        }
+
+        std::string_view GetLine(size_t pos) const {
+            return {text + line_offsets[pos], line_offsets[pos + 1] - line_offsets[pos] - 1};
+        }
+
+        std::string_view GetTerm(size_t term_id) const {
+            return {terms_text + term_offsets[term_id], term_offsets[term_id + 1] - term_offsets[term_id]};
+        }
+
+        std::span<const uint8_t> GetPostings(size_t term_id) const {
+            return postings.subspan(posting_offsets[term_id], posting_offsets[term_id + 1] - posting_offsets[term_id]);
+        }
+
+        std::span<const uint8_t> GetWordPositions(size_t term_id) const {
+            return word_positions.subspan(word_position_offsets[term_id],
+                                          word_position_offsets[term_id + 1] - word_position_offsets[term_id]);
+        }
+
+        template <typename T>
+        std::span<const T> Section(size_t offset, size_t count) const {
+            return {reinterpret_cast<const T*>(file->Data() + offset), count};
+        }
+
+        // Checks everything that is used as an index or a size, so that a corrupt file is rejected
+        // instead of being read out of bounds.
+        bool IsValid() const {
+            // Every line is followed by a line break, so line offsets strictly increase.
+            if (line_offsets.front() != 0 || line_offsets.back() != header->text_size ||
+                std::adjacent_find(line_offsets.begin(), line_offsets.end(), std::greater_equal<>()) !=
+                    line_offsets.end()) {
+                return false;
+            }
+
+            if (!AreOffsetsValid(term_offsets, header->terms_text_size) ||
+                !AreOffsetsValid(posting_offsets, header->postings_size) ||
+                !AreOffsetsValid(word_position_offsets, header->word_positions_size)) {
+                return false;
+            }
+
+            // Lookups stop at an empty slot, so there has to be one.
+            size_t empty_slots_count = 0;
+
+            for (const TermTable::Slot& slot : slots) {
+                if (slot.id == TermTable::EMPTY) {
+                    ++empty_slots_count;
+                } else if (slot.id >= header->terms_count) {
+                    return false;
+                }
+            }
+
+            if (!slots.empty() && empty_slots_count == 0) {
+                return false;
+            }
+
+            size_t removed_lines_count = 0;
+
+            for (uint64_t bits : removed_lines) {
+                removed_lines_count += static_cast<size_t>(std::popcount(bits));
+            }
+
+            if (removed_lines_count != header->removed_lines_count ||
+                (header->lines_count % 64 != 0 && (removed_lines.back() >> (header->lines_count % 64)) != 0)) {
+                return false;
+            }
+
+            if (header->stores_word_positions == 0 && header->word_positions_size != 0) {
+                return false;
+            }
+
+            for (size_t term_id = 0; term_id < header->terms_count; ++term_id) {
+                if (document_frequencies[term_id] > header->lines_count) {
+                    return false;
+                }
+
+                // Lists have to consist of whole varints: pairs of them in postings, and one per
+                // occurrence in word positions.
+                std::optional<size_t> postings_varints_count = Varint::Count(GetPostings(term_id));
+                std::optional<size_t> word_positions_count = Varint::Count(GetWordPositions(term_id));
+
+                if (!postings_varints_count || *postings_varints_count % 2 != 0 || !word_positions_count) {
+                    return false;
+                }
+
+                size_t min_pos = 0;
+                size_t occurrences_count = 0;
+
+                for (PostingListIterator it(GetPostings(term_id)); !it.IsEnd(); it.Next()) {
+                    if (it.Pos() < min_pos || it.Pos() >= header->lines_count || it.Count() == 0 ||
+                        it.Count() > line_lengths[it.Pos()]) {
+                        return false;
+                    }
+
+                    min_pos = it.Pos() + 1;
+                    occurrences_count += it.Count();
+                }
+
+                if (header->stores_word_positions != 0 && *word_positions_count != occurrences_count) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+        static bool AreOffsetsValid(std::span<const uint64_t> offsets, uint64_t size) {
+            return offsets.front() == 0 && offsets.back() == size && std::is_sorted(offsets.begin(), offsets.end());
+        }
+    };
+
+    // Lines are kept as offsets into the texts of the documents they come from. A line ends at
+    // the next line break or at the end of its text.
+    struct TextSegment {
+        size_t first_pos;
+        std::string_view text;
+    };
+
+    // Lines of a segment with their index. Postings hold positions in the whole index, while the
+    // line tables are indexed from the first line of the segment.
+    struct SegmentData {
+        size_t first_pos = 0;
+        InvertedIndex index;
+        std::vector<TextSegment> text_segments;
+        std::vector<uint64_t> line_offsets;
+        std::vector<uint32_t> line_lengths;
+
+        size_t GetEndPos() const {
+            return first_pos + line_offsets.size();
+        }
+
+        std::string_view GetLine(size_t pos) const {
+            auto is_before = [](size_t pos, const TextSegment& segment) { return pos < segment.first_pos; };
+            auto segment = std::prev(std::upper_bound(text_segments.begin(), text_segments.end(), pos, is_before));
+            std::string_view line = segment->text.substr(line_offsets[pos - first_pos]);
+
+            return line.substr(0, line.find('\n'));
+        }
+
+        // Indexes the lines of text after all lines of the segment.
+        void AddLines(std::string_view text, size_t threads_count, bool store_word_positions) {
+            std::vector<std::string_view> lines = GetLinesFromText(text);
+
+            if (lines.empty()) {
+                return;
+            }
+
+            size_t first_line = line_offsets.size();
+            size_t first_line_pos = GetEndPos();
+            text_segments.push_back({.first_pos = first_line_pos, .text = text});
+
+            for (std::string_view line : lines) {
+                line_offsets.push_back(static_cast<uint64_t>(line.data() - text.data()));
+            }
+
+            line_lengths.resize(line_offsets.size());
+            threads_count = std::min(threads_count, lines.size() / MIN_LINES_PER_SHARD);
+
+            if (threads_count <= 1) {
+                for (size_t i = 0; i < lines.size(); ++i) {
+                    line_lengths[first_line + i] = index.AddLine(lines[i], first_line_pos + i, store_word_positions);
+                }
+            } else {
+                std::vector<InvertedIndex> shards(threads_count);
+                std::vector<std::thread> threads;
+
+                for (size_t shard = 0; shard < threads_count; ++shard) {
+                    threads.emplace_back([&, shard] {
+                        size_t begin = lines.size() * shard / threads_count;
+                        size_t end = lines.size() * (shard + 1) / threads_count;
+
+                        for (size_t i = begin; i < end; ++i) {
+                            line_lengths[first_line + i] =
+                                shards[shard].AddLine(lines[i], first_line_pos + i, store_word_positions);
+                        }
+                    });
+                }
+
+                for (auto& thread : threads) {
+                    thread.join();
+                }
+
+                for (const auto& shard : shards) {
+                    index.Append(shard, shard.document_frequencies);
+                }
+            }
+        }
+
+        // Appends the lines of the segment that follows this one, whose terms have the given
+        // document frequencies.
+        void Append(const SegmentData& other, std::span<const size_t> document_frequencies) {
+            index.Append(other.index, document_frequencies);
+            text_segments.insert(text_segments.end(), other.text_segments.begin(), other.text_segments.end());
+            line_offsets.insert(line_offsets.end(), other.line_offsets.begin(), other.line_offsets.end());
+            line_lengths.insert(line_lengths.end(), other.line_lengths.begin(), other.line_lengths.end());
+        }
+
+        // Copies a loaded index into memory. Lines and terms still point into the mapped file,
+        // which Load has kept in the corpus.
+        static SegmentData FromMapped(const MappedIndex& mapped_index) {
+            SegmentData result;
+
+            for (size_t term_id = 0; term_id < mapped_index.header->terms_count; ++term_id) {
+                result.index.InternTerm(mapped_index.GetTerm(term_id));
+                auto postings = mapped_index.GetPostings(term_id);
+                result.index.postings[term_id].assign(postings.begin(), postings.end());
+                auto word_positions = mapped_index.GetWordPositions(term_id);
+                result.index.word_positions[term_id].assign(word_positions.begin(), word_positions.end());
+                result.index.document_frequencies[term_id] = mapped_index.document_frequencies[term_id];
+                result.index.max_tfs[term_id] = mapped_index.max_tfs[term_id];
+
+                for (PostingListIterator it(postings); !it.IsEnd(); it.Next()) {
+                    result.index.last_positions[term_id] = it.Pos();
+                }
+            }
+
+            if (mapped_index.header->lines_count != 0) {
+                std::string_view text(mapped_index.text, mapped_index.header->text_size);
+                result.text_segments.push_back({.first_pos = 0, .text = text});
+            }
+
+            result.line_offsets.assign(mapped_index.line_offsets.begin(), mapped_index.line_offsets.end() - 1);
+            result.line_lengths.assign(mapped_index.line_lengths.begin(), mapped_index.line_lengths.end());
+
+            return result;
+        }
+    };
+
+    // A run of consecutive lines of the index, either built in memory or mapped from an index file.
+    // The lines and postings of a segment never change once it is built, and copies of the index
+    // share them. Only the removed lines and the document frequencies of a segment in memory
+    // change, and they are kept in chunks that copies share until one of them is changed.
+    class Segment {
+    public:
+        explicit Segment(SegmentData data)
+            : data_(std::make_shared<const SegmentData>(std::move(data))),
+              document_frequencies_(data_->index.document_frequencies),
+              removed_lines_(GetBitsetSize(data_->line_offsets.size()), 0) {
+        }
+
+        explicit Segment(std::shared_ptr<const MappedIndex> mapped_index) : mapped_index_(std::move(mapped_index)) {
+        }
+
+        bool IsMapped() const {
+            return mapped_index_ != nullptr;
+        }
+
+        size_t GetFirstPos() const {
+            return mapped_index_ ? 0 : data_->first_pos;
+        }
+
+        size_t GetLinesCount() const {
+            return mapped_index_ ? mapped_index_->header->lines_count : data_->line_offsets.size();
+        }
+
+        size_t GetEndPos() const {
+            return GetFirstPos() + GetLinesCount();
+        }
+
+        size_t GetTermsCount() const {
+            return mapped_index_ ? mapped_index_->header->terms_count : data_->index.terms.Size();
+        }
+
+        std::string_view GetTerm(size_t term_id) const {
+            return mapped_index_ ? mapped_index_->GetTerm(term_id) : data_->index.terms.GetTerm(term_id);
+        }
+
+        std::span<const TermTable::Slot> GetTermSlots() const {
+            return mapped_index_ ? mapped_index_->slots : data_->index.terms.GetSlots();
+        }
+
+        size_t FindTerm(std::string_view word) const {
+            if (mapped_index_) {
+                return TermTable::Find(mapped_index_->slots, word,
+                                       [this](size_t term_id) { return mapped_index_->GetTerm(term_id); });
+            }
+
+            return data_->index.terms.Find(word);
+        }
+
+        std::span<const uint8_t> GetPostings(size_t term_id) const {
+            return mapped_index_ ? mapped_index_->GetPostings(term_id) : data_->index.postings[term_id];
+        }
+
+        std::span<const uint8_t> GetWordPositions(size_t term_id) const {
+            return mapped_index_ ? mapped_index_->GetWordPositions(term_id) : data_->index.word_positions[term_id];
+        }
+
+        size_t GetDocumentFrequency(size_t term_id) const {
+            return mapped_index_ ? mapped_index_->document_frequencies[term_id] : document_frequencies_[term_id];
+        }
+
+        // Largest term frequency of the term over all lines, including removed ones.
+        double GetMaxTf(size_t term_id) const {
+            return mapped_index_ ? mapped_index_->max_tfs[term_id] : data_->index.max_tfs[term_id];
+        }
+
+        std::string_view GetLine(size_t pos) const {
+            return mapped_index_ ? mapped_index_->GetLine(pos) : data_->GetLine(pos);
+        }
+
+        // Numbers of words in the lines, from the first line of the segment.
+        std::span<const uint32_t> GetLineLengths() const {
+            return mapped_index_ ? mapped_index_->line_lengths : std::span<const uint32_t>(data_->line_lengths);
+        }
+
+        uint32_t GetLineLength(size_t pos) const {
+            return GetLineLengths()[pos - GetFirstPos()];
+        }
+
+        bool IsRemoved(size_t pos) const {
+            size_t line = pos - GetFirstPos();
+            uint64_t bits = mapped_index_ ? mapped_index_->removed_lines[line / 64] : removed_lines_[line / 64];
+
+            return (bits >> (line % 64)) & 1;
+        }
+
+        // Lines and index of a segment in memory.
+        const SegmentData& GetData() const {
+            return *data_;
+        }
+
+        std::vector<size_t> GetDocumentFrequencies() const {
+            std::vector<size_t> result(GetTermsCount());
+
+            for (size_t term_id = 0; term_id < result.size(); ++term_id) {
+                result[term_id] = GetDocumentFrequency(term_id);
+            }
+
+            return result;
+        }
+
+        // Copies the lines and the index of the segment, with its current document frequencies.
+        SegmentData ToData() const {
+            if (mapped_index_) {
+                return SegmentData::FromMapped(*mapped_index_);
+            }
+
+            SegmentData result = *data_;
+            result.index.document_frequencies = GetDocumentFrequencies();
+
+            return result;
+        }
+
+        // Copy of the segment in memory, which can be changed.
+        Segment Materialize() const {
+            Segment result(ToData());
+            result.CopyRemovedLines(*this);
+
+            return result;
+        }
+
+        // Marks the lines that are removed in other, which covers a part of this segment, as
+        // removed here. Document frequencies are left as they are.
+        void CopyRemovedLines(const Segment& other) {
+            for (size_t pos = other.GetFirstPos(); pos < other.GetEndPos(); ++pos) {
+                if (other.IsRemoved(pos)) {
+                    MarkRemoved(pos);
+                }
+            }
+        }
+
+        // The segment has to be in memory.
+        void RemoveLine(size_t pos) {
+            MarkRemoved(pos);
+
+            if (GetLineLength(pos) == 0) {
+                return;
+            }
+
+            std::vector<size_t> terms_in_line;
+
+            ForEachWord(GetLine(pos), [&](std::string_view word) {
+                terms_in_line.push_back(data_->index.terms.Find(word));
+            });
+
+            std::sort(terms_in_line.begin(), terms_in_line.end());
+            terms_in_line.erase(std::unique(terms_in_line.begin(), terms_in_line.end()), terms_in_line.end());
+
+            for (size_t term_id : terms_in_line) {
+                --document_frequencies_.GetMutable(term_id);
+            }
+        }
+
+    private:
+        std::shared_ptr<const SegmentData> data_;
+        std::shared_ptr<const MappedIndex> mapped_index_;
+        // Of a segment in memory; those of a mapped segment are in its file.
+        ChunkedVector<size_t> document_frequencies_;
+        // A bitset with bit i set for every removed line i of the segment.
+        ChunkedVector<uint64_t> removed_lines_;
+
+        void MarkRemoved(size_t pos) {
+            size_t line = pos - GetFirstPos();
+            removed_lines_.GetMutable(line / 64) |= uint64_t{1} << (line % 64);
+        }
+    };
+
+    // Segments cover consecutive runs of lines, in order, and each of them is more than
+    // SEGMENT_MERGE_FACTOR times larger than the next one.
+    std::vector<Segment> segments_;
+    size_t removed_lines_count_ = 0;
+    IndexOptions options_;
+    std::shared_ptr<Corpus> corpus_ = std::make_shared<Corpus>();
+    // Changes with every modification of the index, which invalidates cached results.
+    uint64_t generation_ = 0;
+
+    // Generations only move forward across all indexes, so that a new index never reuses cached
+    // results of the one it replaces.
+    static uint64_t NextGeneration() {
+        static std::atomic<uint64_t> last_generation = 0;
+
+        return ++last_generation;
+    }
+
+    // The corpus is kept, so that lines found before stay valid.
+    void Clear() {
+        generation_ = NextGeneration();
+        segments_.clear();
+        removed_lines_count_ = 0;
+    }
+
+    // Adds the segment after all others. The last segments are then merged for as long as the one
+    // before them is at most SEGMENT_MERGE_FACTOR times larger than all of them together. Sizes of
+    // segments thus decrease geometrically, so there are O(log n) of them and a line takes part
+    // in O(log n) merges.
+    void AddSegment(SegmentData data) {
+        if (data.line_offsets.empty()) {
+            return;
+        }
+
+        segments_.emplace_back(std::move(data));
+        size_t merged_count = 1;
+        size_t merged_lines_count = segments_.back().GetLinesCount();
+
+        while (merged_count < segments_.size()) {
+            size_t lines_count = segments_[segments_.size() - merged_count - 1].GetLinesCount();
+
+            if (lines_count > SEGMENT_MERGE_FACTOR * merged_lines_count) {
+                break;
+            }
+
+            merged_lines_count += lines_count;
+            ++merged_count;
+        }
+
+        if (merged_count > 1) {
+            Segment merged = MergeSegments(std::span(segments_).last(merged_count));
+            segments_.erase(segments_.end() - static_cast<ptrdiff_t>(merged_count), segments_.end());
+            segments_.push_back(std::move(merged));
+        }
+    }
+
+    // Writes the segment, which covers all lines of the index.
+    bool SaveSegment(const Segment& segment, const std::string& path) const {
+        IndexFileHeader header;
+        std::copy(std::begin(INDEX_FILE_MAGIC), std::end(INDEX_FILE_MAGIC), header.magic);
+        header.lines_count = segment.GetLinesCount();
+        header.terms_count = segment.GetTermsCount();
+        header.stores_word_positions = options_.store_word_positions;
+        header.slots_count = segment.GetTermSlots().size();
+
+        header.removed_lines_count = removed_lines_count_;
+
+        // Every line is followed by a line break, so that the text can be split into lines again
+        // once it is modified.
+        std::vector<uint64_t> line_offsets = {0};
+        std::vector<uint64_t> removed_lines(GetBitsetSize(header.lines_count));
+
+        for (size_t pos = 0; pos < header.lines_count; ++pos) {
+            header.text_size += (segment.IsRemoved(pos) ? 0 : segment.GetLine(pos).size()) + 1;
+            removed_lines[pos / 64] |= static_cast<uint64_t>(segment.IsRemoved(pos)) << (pos % 64);
+            line_offsets.push_back(header.text_size);
+        }
+
+        std::vector<uint64_t> term_offsets = {0};
+        std::vector<uint64_t> posting_offsets = {0};
+        std::vector<uint8_t> postings;
+        std::vector<uint64_t> word_position_offsets = {0};
+        std::vector<uint8_t> word_positions;
+        std::vector<uint64_t> document_frequencies;
+        std::vector<double> max_tfs;
+
+        for (size_t term_id = 0; term_id < header.terms_count; ++term_id) {
+            header.terms_text_size += segment.GetTerm(term_id).size();
+            term_offsets.push_back(header.terms_text_size);
+            std::span<const uint8_t> term_postings = segment.GetPostings(term_id);
+            std::span<const uint8_t> term_word_positions = segment.GetWordPositions(term_id);
+
+            if (header.removed_lines_count == 0) {
+                postings.insert(postings.end(), term_postings.begin(), term_postings.end());
+                word_positions.insert(word_positions.end(), term_word_positions.begin(), term_word_positions.end());
+            } else {
+                size_t last_pos = 0;
+                std::vector<uint32_t> offsets;
+
+                for (PositionalPostingIterator it(term_postings, term_word_positions); !it.IsEnd(); it.Next()) {
+                    if (segment.IsRemoved(it.Pos())) {
+                        continue;
+                    }
+
+                    Varint::Write(postings, it.Pos() - last_pos);
+                    Varint::Write(postings, it.Count());
+                    last_pos = it.Pos();
+
+                    if (it.HasWordPositions()) {
+                        it.GetWordPositions(offsets);
+
+                        for (size_t i = 0; i < offsets.size(); ++i) {
+                            Varint::Write(word_positions, offsets[i] - (i == 0 ? 0 : offsets[i - 1]));
+                        }
+                    }
+                }
+            }
+
+            posting_offsets.push_back(postings.size());
+            word_position_offsets.push_back(word_positions.size());
+            document_frequencies.push_back(segment.GetDocumentFrequency(term_id));
+            max_tfs.push_back(segment.GetMaxTf(term_id));
+        }
+
+        header.postings_size = postings.size();
+        header.word_positions_size = word_positions.size();
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        IndexFileLayout layout(header);
+        size_t written = 0;
+
+        auto write = [&](size_t offset, const void* data, size_t size) {
+            static constexpr char PADDING[8] = {};
+            out.write(PADDING, static_cast<std::streamsize>(offset - written));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            written = offset + size;
+        };
+
+        write(0, &header, sizeof(header));
+        write(layout.line_offsets, line_offsets.data(), line_offsets.size() * sizeof(uint64_t));
+        write(layout.line_lengths, segment.GetLineLengths().data(), segment.GetLineLengths().size() * sizeof(uint32_t));
+        write(layout.term_offsets, term_offsets.data(), term_offsets.size() * sizeof(uint64_t));
+        write(layout.slots, segment.GetTermSlots().data(), segment.GetTermSlots().size() * sizeof(TermTable::Slot));
+        write(layout.posting_offsets, posting_offsets.data(), posting_offsets.size() * sizeof(uint64_t));
+        write(layout.postings, postings.data(), postings.size());
+        write(layout.word_position_offsets, word_position_offsets.data(),
+              word_position_offsets.size() * sizeof(uint64_t));
+        write(layout.word_positions, word_positions.data(), word_positions.size());
+
+        write(layout.document_frequencies, document_frequencies.data(), document_frequencies.size() * sizeof(uint64_t));
+        write(layout.max_tfs, max_tfs.data(), max_tfs.size() * sizeof(double));
+        write(layout.removed_lines, removed_lines.data(), removed_lines.size() * sizeof(uint64_t));
+        write(layout.text, nullptr, 0);
+
+        for (size_t pos = 0; pos < header.lines_count; ++pos) {
+            if (!segment.IsRemoved(pos)) {
+                write(written, segment.GetLine(pos).data(), segment.GetLine(pos).size());
+            }
+
+            write(written, "\n", 1);
+        }
+
+        write(layout.terms_text, nullptr, 0);
+
+        for (size_t term_id = 0; term_id < header.terms_count; ++term_id) {
+            write(written, segment.GetTerm(term_id).data(), segment.GetTerm(term_id).size());
+        }
+
+        write(layout.size, nullptr, 0);
+        out.flush();
+
+        return out.good();
+    }
+
+    // Merges consecutive segments into one in memory. Removed lines stay removed.
+    static Segment MergeSegments(std::span<const Segment> segments) {
+        SegmentData data = segments.front().ToData();
+
+        for (const Segment& segment : segments.subspan(1)) {
+            if (segment.IsMapped()) {
+                SegmentData other = segment.ToData();
+                data.Append(other, other.index.document_frequencies);
+            } else {
+                data.Append(segment.GetData(), segment.GetDocumentFrequencies());
             }
+        }
 
-            if (std::tolower(lhs[i]) > std::tolower(rhs[i])) {
-                return false;
+        Segment result(std::move(data));
+
+        for (const Segment& segment : segments) {
+            result.CopyRemovedLines(segment);
+        }
+
+        return result;
+    }
+
+    // Index of the segment that has the line.
+    size_t FindSegment(size_t pos) const {
+        auto segment = std::upper_bound(segments_.begin(), segments_.end(), pos,
+                                        [](size_t pos, const Segment& segment) { return pos < segment.GetFirstPos(); });
+
+        return static_cast<size_t>(segment - segments_.begin()) - 1;
+    }
+
+    std::string_view GetLine(size_t pos) const {
+        return segments_[FindSegment(pos)].GetLine(pos);
+    }
+
+    bool IsRemoved(size_t pos) const {
+        return segments_[FindSegment(pos)].IsRemoved(pos);
+    }
+
+    // Number of distinct terms over all segments.
+    size_t GetVocabularySize() const {
+        if (segments_.size() == 1) {
+            return segments_.front().GetTermsCount();
+        }
+
+        TermTable terms;
+
+        for (const Segment& segment : segments_) {
+            for (size_t term_id = 0; term_id < segment.GetTermsCount(); ++term_id) {
+                terms.Insert(segment.GetTerm(term_id));
             }
         }
 
-        if (lhs.size() < rhs.size()) {
-            return true;
+        return terms.Size();
+    }
+
+    // Document frequency of a term with the given ids in the segments.
+    size_t GetDocumentFrequency(std::span<const size_t> ids) const {
+        size_t result = 0;
+
+        for (size_t i = 0; i < segments_.size(); ++i) {
+            if (ids[i] != TermTable::NPOS) {
+                result += segments_[i].GetDocumentFrequency(ids[i]);
+            }
         }
 
-        return false;
+        return result;
     }
-};
 
-class SearchEngine {
-public:
-    struct RelevanceAndPos {
-        double relevance = 0.0;
-        size_t pos;
+    double GetMaxTf(std::span<const size_t> ids) const {
+        double result = 0.0;
+
+        for (size_t i = 0; i < segments_.size(); ++i) {
+            if (ids[i] != TermTable::NPOS) {
+                result = std::max(result, segments_[i].GetMaxTf(ids[i]));
+            }
+        }
+
+        return result;
+    }
+
+    static size_t GetBitsetSize(size_t bits_count) {
+        return (bits_count + 63) / 64;
+    }
+
+    // Distinct words of a query that occur in the index, folded to lower case and sorted, with the
+    // id of each of them in every segment, which is TermTable::NPOS where the segment lacks it.
+    struct QueryTerms {
+        std::pmr::vector<std::pmr::string> words;
+        std::pmr::vector<size_t> ids;
+        size_t segments_count = 0;
+
+        std::span<const size_t> GetIds(size_t word) const {
+            return std::span(ids).subspan(word * segments_count, segments_count);
+        }
     };
 
-    void BuildIndex(std::string_view text) {
-        std::vector<std::vector<std::string_view>> words_in_lines;
-        words_relevance_in_lines_.clear();
-        ignore_list_.clear();
-        lines_ = GetLinesFromText(text);
-        text_words_ = GetUniqueWordsFromStringView(text);
+    // Iterates over the postings of a query term in all segments, skipping removed lines.
+    struct TermCursor {
+        static constexpr size_t END = static_cast<size_t>(-1);
 
-        for (size_t i = 0; i < lines_.size(); ++i) {
-            words_in_lines.emplace_back(GetWordsFromStringView(lines_[i]));
+        std::span<const Segment> segments;
+        std::span<const size_t> ids;
+        size_t segment = 0;
+        PostingListIterator postings{std::span<const uint8_t>()};
+        double idf = 0.0;
+        double upper_bound = 0.0;
+        size_t query_order = 0;
 
-            if (words_in_lines[i].empty()) {
-                ignore_list_.insert(i);
-            }
+        size_t Pos() const {
+            return postings.IsEnd() ? END : postings.Pos();
         }
 
-        std::unordered_map<std::string_view, std::vector<double>> word_tf_in_line;
-        std::unordered_map<std::string_view, double> word_idf;
+        double GetRelevance() const {
+            double tf = static_cast<double>(postings.Count()) /
+                        static_cast<double>(segments[segment].GetLineLength(postings.Pos()));
+            return tf * idf;
+        }
 
-        for (size_t i = 0; i < words_in_lines.size(); ++i) {
-            if (ignore_list_.find(i) != ignore_list_.end()) {
-                continue;
+        bool IsRemoved() const {
+            return segments[segment].IsRemoved(postings.Pos());
+        }
+
+        void Next() {
+            postings.Next();
+
+            if (postings.IsEnd()) {
+                StartSegment(segment + 1, 0);
             }
+        }
 
-            auto temp = GetTFOfWordsInLine(words_in_lines[i], text_words_);
+        // Moves to the first posting in the first segment from first_segment on that has the
+        // term and ends after pos.
+        void StartSegment(size_t first_segment, size_t pos) {
+            for (segment = first_segment; segment < segments.size(); ++segment) {
+                if (ids[segment] != TermTable::NPOS && segments[segment].GetEndPos() > pos) {
+                    postings = PostingListIterator(segments[segment].GetPostings(ids[segment]));
 
-            for (const auto& word : text_words_) {
-                word_tf_in_line[word].emplace_back(temp[word]);
-                if (temp[word] != 0.0) {
-                    ++word_idf[word];
+                    if (!postings.IsEnd()) {
+                        return;
+                    }
                 }
             }
         }
+    };
+
+    // Positions of the results_count most relevant lines for the query terms, in the order of Search.
+    std::pmr::vector<size_t> GetTopPositions(const QueryTerms& terms, size_t results_count,
+                                             std::pmr::memory_resource* memory, QueryStats* stats) const {
+        // Lines are scored in increasing order of pos with MaxScore pruning. Cursors are sorted by the
+        // upper bound of their term's contribution, and once the results are full, the terms whose
+        // bounds add up to less than what is needed to get into them become non-essential: a line
+        // is considered only if an essential term occurs in it, and non-essential cursors are moved
+        // to it only while the line can still get into the results.
+        std::pmr::vector<TermCursor> cursors = GetQueryCursors(terms, memory, stats);
+        std::sort(cursors.begin(), cursors.end(), [](const TermCursor& lhs, const TermCursor& rhs) {
+            return lhs.upper_bound < rhs.upper_bound;
+        });
+
+        std::pmr::vector<double> upper_bounds_sums(cursors.size(), memory);
+        std::pmr::vector<double> contributions(cursors.size(), memory);
+        std::pmr::vector<RelevanceAndPos> top_lines(memory);
+        top_lines.reserve(std::min(results_count, MAX_RESERVED_RESULTS));
+        size_t first_essential = 0;
+
+        for (size_t i = 0; i < cursors.size(); ++i) {
+            upper_bounds_sums[i] = cursors[i].upper_bound + (i == 0 ? 0.0 : upper_bounds_sums[i - 1]);
+        }
 
-        for (const auto& word : text_words_) {
-            if (word_idf[word] != 0.0) {
-                word_idf[word] = std::log(static_cast<double>(lines_.size()) / word_idf[word]);
+        while (true) {
+            size_t pos = TermCursor::END;
+
+            for (size_t i = first_essential; i < cursors.size(); ++i) {
+                pos = std::min(pos, cursors[i].Pos());
             }
-        }
 
-        for (size_t i = 0; i < lines_.size(); ++i) {
-            if (ignore_list_.find(i) != ignore_list_.end()) {
+            if (pos == TermCursor::END) {
+                break;
+            }
+
+            double relevance_bound = 0.0;
+            std::fill(contributions.begin(), contributions.end(), 0.0);
+
+            for (size_t i = first_essential; i < cursors.size(); ++i) {
+                if (cursors[i].Pos() == pos) {
+                    contributions[cursors[i].query_order] = cursors[i].GetRelevance();
+                    relevance_bound += contributions[cursors[i].query_order];
+                    MoveToNextLiveLine(cursors[i], pos + 1, stats);
+                }
+            }
+
+            bool may_enter = true;
+
+            for (size_t i = first_essential; i-- > 0;) {
+                if (top_lines.size() == results_count &&
+                    !MayEnterTop(relevance_bound + upper_bounds_sums[i], top_lines.front())) {
+                    may_enter = false;
+                    break;
+                }
+
+                MoveToNextLiveLine(cursors[i], pos, stats);
+
+                if (cursors[i].Pos() == pos) {
+                    contributions[cursors[i].query_order] = cursors[i].GetRelevance();
+                    relevance_bound += contributions[cursors[i].query_order];
+                }
+            }
+
+            if (!may_enter) {
                 continue;
             }
 
-            for (const auto& word : text_words_) {
-                words_relevance_in_lines_[word].emplace_back(word_tf_in_line[word][i] * word_idf[word]);
+            // Summed in the order of the query terms, as in SearchBatch.
+            double relevance = 0.0;
+
+            for (double contribution : contributions) {
+                relevance += contribution;
+            }
+
+            AddStats(stats, &QueryStats::candidates_scored, 1);
+
+            if (PushToTop(top_lines, {.relevance = relevance, .pos = pos}, results_count)) {
+                AddStats(stats, &QueryStats::heap_operations, 1);
+            }
+
+            while (top_lines.size() == results_count && first_essential < cursors.size() &&
+                   !MayEnterTop(upper_bounds_sums[first_essential], top_lines.front())) {
+                ++first_essential;
             }
         }
-    }
 
-    std::vector<std::string_view> Search(std::string_view query, size_t results_count) const {
-        std::vector<std::string_view> result;
+        std::pmr::vector<size_t> result(memory);
+        std::sort_heap(top_lines.begin(), top_lines.end(), IsMoreRelevant);
+        result.reserve(top_lines.size());
 
-        if (results_count == 0 || lines_.empty()) {
-            return result;
+        for (const auto& line : top_lines) {
+            result.push_back(line.pos);
         }
 
-        std::set<std::string_view, Comp> query_words = GetUniqueWordsFromStringView(query);
-        std::vector<RelevanceAndPos> lines_relevance;
+        return result;
+    }
+
+    // Cursors of the query terms with a non-zero contribution, numbered in the order of the terms.
+    std::pmr::vector<TermCursor> GetQueryCursors(const QueryTerms& terms, std::pmr::memory_resource* memory,
+                                                 QueryStats* stats) const {
+        std::pmr::vector<TermCursor> result(memory);
+        result.reserve(terms.words.size());
+        double lines_count = static_cast<double>(GetLinesCount() - removed_lines_count_);
 
-        for (size_t i = 0; i < lines_.size(); ++i) {
-            if (ignore_list_.find(i) != ignore_list_.end()) {
+        for (size_t i = 0; i < terms.words.size(); ++i) {
+            std::span<const size_t> ids = terms.GetIds(i);
+            size_t document_frequency = GetDocumentFrequency(ids);
+
+            if (document_frequency == 0) {
                 continue;
             }
 
-            RelevanceAndPos temp = {.relevance = 0., .pos = i};
+            double idf = std::log(lines_count / static_cast<double>(document_frequency));
 
-            for (const auto& word : query_words) {
-                if (auto it = words_relevance_in_lines_.find(word); it != words_relevance_in_lines_.end()) {
-                    temp.relevance += it->second[i];
-                }
+            if (idf == 0.0) {
+                continue;
             }
 
-            lines_relevance.emplace_back(temp);
+            result.push_back({.segments = segments_,
+                              .ids = ids,
+                              .idf = idf,
+                              .upper_bound = GetMaxTf(ids) * idf,
+                              .query_order = result.size()});
+            result.back().StartSegment(0, 0);
+            MoveToNextLiveLine(result.back(), 0, stats);
         }
 
-        std::sort(lines_relevance.rbegin(), lines_relevance.rend(),
-                  [](const RelevanceAndPos& lhs, const RelevanceAndPos& rhs) {
-                      if (std::abs(lhs.relevance - rhs.relevance) < ERROR) {
-                          return rhs.pos < lhs.pos;
-                      }
+        return result;
+    }
+
+    // Moves the cursor to the first line at or after pos that is not removed. Segments that end
+    // before pos are skipped without going through their postings.
+    void MoveToNextLiveLine(TermCursor& cursor, size_t pos, QueryStats* stats) const {
+        bool has_removed_lines = removed_lines_count_ != 0;
+        uint64_t postings_scanned = 0;
 
-                      return lhs.relevance < rhs.relevance;
-                  });
+        if (cursor.Pos() < pos && cursor.segments[cursor.segment].GetEndPos() <= pos) {
+            cursor.StartSegment(cursor.segment + 1, pos);
+        }
 
-        for (size_t i = 0; i < lines_relevance.size(); ++i) {
-            if (i >= results_count || lines_relevance[i].relevance == 0.0) {
-                break;
+        while (cursor.Pos() < pos || (has_removed_lines && cursor.Pos() != TermCursor::END && cursor.IsRemoved())) {
+            cursor.Next();
+            ++postings_scanned;
+        }
+
+        AddStats(stats, &QueryStats::postings_scanned, postings_scanned);
+    }
+
+    static void AddStats(QueryStats* stats, uint64_t QueryStats::*counter, uint64_t value) {
+        if constexpr (QUERY_STATS_ENABLED) {
+            if (stats != nullptr) {
+                stats->*counter += value;
             }
+        }
+    }
 
-            result.emplace_back(lines_[lines_relevance[i].pos]);
+    static std::chrono::steady_clock::time_point GetStatsTime(QueryStats* stats) {
+        if constexpr (QUERY_STATS_ENABLED) {
+            if (stats != nullptr) {
+                return std::chrono::steady_clock::now();
+            }
         }
 
-        return result;
+        return {};
     }
 
-private:
-    std::set<std::string_view, Comp> text_words_;
-    std::unordered_map<std::string_view, std::vector<double>> words_relevance_in_lines_;
-    std::vector<std::string_view> lines_;
-    std::set<size_t> ignore_list_;
+    static void AddStatsTime(QueryStats* stats, std::chrono::nanoseconds QueryStats::*time,
+                             std::chrono::steady_clock::time_point start_time) {
+        if constexpr (QUERY_STATS_ENABLED) {
+            if (stats != nullptr) {
+                stats->*time += std::chrono::steady_clock::now() - start_time;
+            }
+        }
+    }
 
-    std::vector<std::string_view> GetWordsFromStringView(const std::string_view& str) const {
-        size_t start_pos = 0;
-        size_t finish_pos = start_pos;
-        std::vector<std::string_view> result;
+    // Whether a line scored at most bound, that comes after all lines in the heap, can still
+    // displace its least relevant line. The bound is slightly inflated to cover rounding errors.
+    static bool MayEnterTop(double bound, const RelevanceAndPos& least_relevant) {
+        return bound * (1.0 + 1e-12) - least_relevant.relevance >= ERROR;
+    }
 
-        while (start_pos < str.size()) {
-            while (start_pos < str.size() && !std::isalpha(str[start_pos])) {
-                ++start_pos;
+    static bool IsMoreRelevant(const RelevanceAndPos& lhs, const RelevanceAndPos& rhs) {
+        if (std::abs(lhs.relevance - rhs.relevance) < ERROR) {
+            return lhs.pos < rhs.pos;
+        }
+
+        return lhs.relevance > rhs.relevance;
+    }
+
+    // Keeps the results_count most relevant lines as a heap with the least relevant one on top.
+    // Returns whether the line got into the heap.
+    template <typename Vector>
+    static bool PushToTop(Vector& top_lines, const RelevanceAndPos& line, size_t results_count) {
+        if (line.relevance == 0.0) {
+            return false;
+        }
+
+        if (top_lines.size() < results_count) {
+            top_lines.push_back(line);
+            std::push_heap(top_lines.begin(), top_lines.end(), IsMoreRelevant);
+        } else if (IsMoreRelevant(line, top_lines.front())) {
+            std::pop_heap(top_lines.begin(), top_lines.end(), IsMoreRelevant);
+            top_lines.back() = line;
+            std::push_heap(top_lines.begin(), top_lines.end(), IsMoreRelevant);
+        } else {
+            return false;
+        }
+
+        return true;
+    }
+
+    // Calls callback(pos, relevance) with the contribution of the term with the given ids in the
+    // segments to every live line containing it.
+    template <typename Callback>
+    void ForEachScoredPosting(std::span<const size_t> ids, Callback&& callback) const {
+        size_t document_frequency = GetDocumentFrequency(ids);
+
+        if (document_frequency == 0) {
+            return;
+        }
+
+        double lines_count = static_cast<double>(GetLinesCount() - removed_lines_count_);
+        double idf = std::log(lines_count / static_cast<double>(document_frequency));
+        bool has_removed_lines = removed_lines_count_ != 0;
+
+        for (size_t i = 0; i < segments_.size(); ++i) {
+            if (ids[i] == TermTable::NPOS) {
+                continue;
             }
 
-            if (start_pos == str.size()) {
-                break;
+            const Segment& segment = segments_[i];
+
+            for (PostingListIterator it(segment.GetPostings(ids[i])); !it.IsEnd(); it.Next()) {
+                if (has_removed_lines && segment.IsRemoved(it.Pos())) {
+                    continue;
+                }
+
+                double tf = static_cast<double>(it.Count()) / static_cast<double>(segment.GetLineLength(it.Pos()));
+                callback(it.Pos(), tf * idf);
             }
+        }
+    }
+
+    // Turns the heap built by PushToTop into the lines ordered by decreasing relevance.
+    template <typename Vector>
+    std::vector<std::string_view> GetTopLines(Vector& top_lines) const {
+        std::vector<std::string_view> result;
+        std::sort_heap(top_lines.begin(), top_lines.end(), IsMoreRelevant);
+
+        for (const auto& line : top_lines) {
+            result.emplace_back(GetLine(line.pos));
+        }
 
-            finish_pos = start_pos + 1;
+        return result;
+    }
 
-            while (finish_pos < str.size() && std::isalpha(str[finish_pos])) {
-                ++finish_pos;
+    // Fills word_positions with the offsets of every term of the segment in the line, from the
+    // index if it has them and from the text of the line otherwise. Cursors are at the line.
+    template <typename Cursors, typename WordPositions>
+    static void GetWordPositionsInLine(const Segment& segment, size_t pos, std::span<const size_t> terms,
+                                       const Cursors& cursors, WordPositions& word_positions) {
+        if (cursors.front().HasWordPositions()) {
+            for (size_t i = 0; i < cursors.size(); ++i) {
+                cursors[i].GetWordPositions(word_positions[i]);
             }
 
-            if (finish_pos == str.size()) {
-                result.emplace_back(str.substr(start_pos));
-                break;
+            return;
+        }
+
+        for (auto& offsets : word_positions) {
+            offsets.clear();
+        }
+
+        uint32_t offset = 0;
+
+        ForEachWord(segment.GetLine(pos), [&](std::string_view word) {
+            size_t term_id = segment.FindTerm(word);
+            auto term = std::lower_bound(terms.begin(), terms.end(), term_id);
+
+            if (term != terms.end() && *term == term_id) {
+                word_positions[term - terms.begin()].push_back(offset);
             }
 
-            result.emplace_back(str.substr(start_pos, finish_pos - start_pos));
-            start_pos = finish_pos + 1;
+            ++offset;
+        });
+    }
+
+    // Counts the offsets at which the phrase starts: from each offset of its first word, every
+    // next word is taken at its first offset after the previous one, which gives the shortest span.
+    template <typename WordPositions>
+    static size_t CountPhraseOccurrences(std::span<const size_t> phrase_cursors, const WordPositions& word_positions,
+                                         size_t slop) {
+        // Saturates, so that a huge slop allows any span instead of wrapping around to a small one.
+        size_t phrase_span = phrase_cursors.size() - 1;
+        size_t max_span = slop > SIZE_MAX - phrase_span ? SIZE_MAX : phrase_span + slop;
+        size_t count = 0;
+
+        for (uint32_t start : word_positions[phrase_cursors.front()]) {
+            uint32_t offset = start;
+            bool found = true;
+
+            for (size_t i = 1; i < phrase_cursors.size() && found; ++i) {
+                const auto& offsets = word_positions[phrase_cursors[i]];
+                auto next = std::upper_bound(offsets.begin(), offsets.end(), offset);
+                found = next != offsets.end() && *next - start <= max_span;
+
+                if (found) {
+                    offset = *next;
+                }
+            }
+
+            count += found ? 1 : 0;
         }
 
-        return result;
+        return count;
     }
 
-    std::set<std::string_view, Comp> GetUniqueWordsFromStringView(const std::string_view& str) const {
-        size_t start_pos = 0;
-        size_t finish_pos = start_pos;
-        std::set<std::string_view, Comp> result;
+    // Words are maximal runs of ASCII letters. They are found by scanning 64-byte blocks for the
+    // bits where the letter mask changes.
+    template <typename Callback>
+    static void ForEachWord(std::string_view str, Callback&& callback) {
+        size_t word_start = str.npos;
+        uint64_t previous_letter = 0;
 
-        while (start_pos < str.size()) {
-            while (start_pos < str.size() && !std::isalpha(str[start_pos])) {
-                ++start_pos;
+        for (size_t block = 0; block < str.size(); block += 64) {
+            uint64_t letters = LetterMask::Get(str.data() + block, str.size() - block);
+            uint64_t edges = letters ^ ((letters << 1) | previous_letter);
+            previous_letter = letters >> 63;
+
+            while (edges != 0) {
+                size_t pos = block + static_cast<size_t>(std::countr_zero(edges));
+                edges &= edges - 1;
+
+                if (word_start == str.npos) {
+                    word_start = pos;
+                } else {
+                    callback(str.substr(word_start, pos - word_start));
+                    word_start = str.npos;
+                }
             }
+        }
 
-            if (start_pos == str.size()) {
-                break;
+        if (word_start != str.npos) {
+            callback(str.substr(word_start));
+        }
+    }
+
+    QueryTerms GetQueryTerms(std::string_view query, std::pmr::memory_resource* memory) const {
+        QueryTerms result = {.words = std::pmr::vector<std::pmr::string>(memory),
+                             .ids = std::pmr::vector<size_t>(memory),
+                             .segments_count = segments_.size()};
+
+        // Words consist of ASCII letters, which setting bit 5 turns to lower case.
+        ForEachWord(query, [&](std::string_view word) {
+            result.words.emplace_back(word);
+
+            for (char& letter : result.words.back()) {
+                letter = static_cast<char>(letter | 0x20);
             }
+        });
 
-            finish_pos = start_pos + 1;
+        std::sort(result.words.begin(), result.words.end());
+        result.words.erase(std::unique(result.words.begin(), result.words.end()), result.words.end());
+        size_t words_count = 0;
 
-            while (finish_pos < str.size() && std::isalpha(str[finish_pos])) {
-                ++finish_pos;
+        for (size_t i = 0; i < result.words.size(); ++i) {
+            bool is_found = false;
+
+            for (const Segment& segment : segments_) {
+                result.ids.push_back(segment.FindTerm(result.words[i]));
+                is_found |= result.ids.back() != TermTable::NPOS;
             }
 
-            if (finish_pos == str.size()) {
-                result.insert(str.substr(start_pos));
-                break;
+            if (!is_found) {
+                result.ids.resize(result.ids.size() - segments_.size());
+                continue;
             }
 
-            result.insert(str.substr(start_pos, finish_pos - start_pos));
-            start_pos = finish_pos + 1;
+            if (words_count != i) {
+                result.words[words_count] = std::move(result.words[i]);
+            }
+
+            ++words_count;
         }
 
+        result.words.resize(words_count);
+
         return result;
     }
 
-    std::vector<std::string_view> GetLinesFromText(const std::string_view& text) const {
+    static std::vector<std::string_view> GetLinesFromText(const std::string_view& text) {
         size_t start_pos = 0;
         size_t finish_pos = 0;
         std::vector<std::string_view> result;
 
-        do {
+        while (start_pos < text.size()) {
             finish_pos = text.find('\n', start_pos);
 
             if (finish_pos == start_pos) {
@@ -222,24 +2571,232 @@ private:
 
             result.emplace_back(text.substr(start_pos, finish_pos - start_pos));
             start_pos = finish_pos + 1;
-        } while (start_pos < text.size());
+        }
 
         return result;
     }
+};
+
+// Shared pointer that readers copy without locking while a writer replaces it, in the manner of
+// RCU: the replaced pointer is released only once no reader may still be copying it. Readers that
+// got a copy keep the object alive for as long as they need it.
+template <typename T>
+class RcuPointer {
+public:
+    explicit RcuPointer(std::shared_ptr<T> value) : current_(new std::shared_ptr<T>(std::move(value))) {
+    }
+
+    RcuPointer(const RcuPointer&) = delete;
+    RcuPointer& operator=(const RcuPointer&) = delete;
+
+    ~RcuPointer() {
+        delete current_.load();
+    }
+
+    std::shared_ptr<T> Load() const {
+        // A reader is counted in the epoch it started in. The epoch is checked again after that,
+        // so that a writer which has already moved on to the next epoch does not miss the reader.
+        while (true) {
+            uint64_t epoch = epoch_.load();
+            readers_counts_[epoch % 2].fetch_add(1);
 
-    std::unordered_map<std::string_view, double> GetTFOfWordsInLine(
-        const std::vector<std::string_view>& words_in_line, const std::set<std::string_view, Comp>& keywords) const {
-        std::unordered_map<std::string_view, double> result;
-        for (const auto& word : words_in_line) {
-            if (const auto it = keywords.find(word); it != keywords.end()) {
-                ++result[*it];
+            if (epoch_.load() == epoch) {
+                std::shared_ptr<T> value = *current_.load();
+                readers_counts_[epoch % 2].fetch_sub(1);
+
+                return value;
             }
+
+            readers_counts_[epoch % 2].fetch_sub(1);
         }
+    }
+
+    // Stores must not run concurrently with each other.
+    void Store(std::shared_ptr<T> value) {
+        std::shared_ptr<T>* previous = current_.exchange(new std::shared_ptr<T>(std::move(value)));
+        uint64_t epoch = epoch_.fetch_add(1);
 
-        for (const std::string_view& word : keywords) {
-            result[word] /= static_cast<double>(words_in_line.size());
+        // Only readers of the previous epoch can still see the previous pointer, and they hold it
+        // just for the time of copying.
+        while (readers_counts_[epoch % 2].load() != 0) {
+            std::this_thread::yield();
         }
 
-        return result;
+        delete previous;
+    }
+
+private:
+    std::atomic<std::shared_ptr<T>*> current_;
+    std::atomic<uint64_t> epoch_ = 0;
+    mutable std::atomic<size_t> readers_counts_[2] = {0, 0};
+};
+
+// Serves searches from immutable snapshots of the index while it is being rebuilt or updated.
+// Every change is made on a new SearchIndex, built from scratch or copied from the current one,
+// which shares its segments with the copy and so costs only what the change touches. The new
+// index is then published atomically: searches never wait for a change, and those already
+// running keep the snapshot they started with. Changes are serialized with each other.
+// Every index the engine builds keeps the text it copies or maps in one corpus of the engine, so
+// found lines stay valid for as long as the engine lives, however it is rebuilt meanwhile.
+class SearchEngine {
+public:
+    using RelevanceAndPos = SearchIndex::RelevanceAndPos;
+
+    // The options apply to every index built by the engine. An index loaded from a file keeps
+    // the options it was saved with.
+    explicit SearchEngine(IndexOptions options = {}) : options_(options) {
+    }
+
+    // The text is not copied and has to outlive the engine.
+    void BuildIndex(std::string_view text, size_t threads_count = 1) {
+        Rebuild([&](SearchIndex& index) {
+            index.BuildIndex(text, threads_count);
+            return true;
+        });
+    }
+
+    bool BuildIndexFromFile(const std::string& path, size_t threads_count = 1) {
+        return Rebuild([&](SearchIndex& index) { return index.BuildIndexFromFile(path, threads_count); });
+    }
+
+    // The text is not copied and has to outlive the engine.
+    size_t AddDocument(std::string_view text, size_t threads_count = 1) {
+        size_t first_pos = 0;
+
+        Update([&](SearchIndex& index) {
+            first_pos = index.AddDocument(text, threads_count);
+            return true;
+        });
+
+        return first_pos;
+    }
+
+    size_t AddDocumentCopy(std::string_view text, size_t threads_count = 1) {
+        size_t first_pos = 0;
+
+        Update([&](SearchIndex& index) {
+            first_pos = index.AddDocumentCopy(text, threads_count);
+            return true;
+        });
+
+        return first_pos;
+    }
+
+    std::optional<size_t> AddDocumentFromFile(const std::string& path, size_t threads_count = 1) {
+        std::optional<size_t> first_pos;
+
+        Update([&](SearchIndex& index) {
+            first_pos = index.AddDocumentFromFile(path, threads_count);
+            return first_pos.has_value();
+        });
+
+        return first_pos;
+    }
+
+    // Source is a read callback or an input stream, as for SearchIndex::AddDocumentFromStream.
+    template <typename Source>
+    bool BuildIndexFromStream(Source&& source, size_t threads_count = 1) {
+        return Rebuild([&](SearchIndex& index) {
+            return index.BuildIndexFromStream(std::forward<Source>(source), threads_count);
+        });
+    }
+
+    template <typename Source>
+    std::optional<size_t> AddDocumentFromStream(Source&& source, size_t threads_count = 1) {
+        std::optional<size_t> first_pos;
+
+        Update([&](SearchIndex& index) {
+            first_pos = index.AddDocumentFromStream(std::forward<Source>(source), threads_count);
+            return first_pos.has_value();
+        });
+
+        return first_pos;
+    }
+
+    void RemoveLine(size_t pos) {
+        Update([&](SearchIndex& index) {
+            index.RemoveLine(pos);
+            return true;
+        });
+    }
+
+    // Applies several changes to one copy of the index and publishes them together. Nothing is
+    // published if callback(index) returns false.
+    template <typename Callback>
+    bool Update(Callback&& callback) {
+        std::lock_guard lock(update_mutex_);
+        auto index = std::make_shared<SearchIndex>(*snapshot_.Load());
+
+        return Publish(std::move(index), callback);
+    }
+
+    // Keeps the results of up to capacity recent queries, so that repeated ones are not scored
+    // again until the index changes. Queries are matched by their set of terms, regardless of the
+    // case and the order of the words. A capacity of 0 turns the cache off. The cache is split into
+    // shards with locks of their own, and a search that finds its shard locked by another thread
+    // goes without the cache instead of waiting, so searches on other threads never block it.
+    void SetQueryCacheCapacity(size_t capacity) {
+        std::lock_guard lock(update_mutex_);
+        query_cache_.Store(capacity == 0 ? nullptr : std::make_shared<QueryCache>(capacity));
+    }
+
+    size_t GetLinesCount() const {
+        return GetSnapshot()->GetLinesCount();
+    }
+
+    IndexStats GetStats() const {
+        return GetSnapshot()->GetStats();
+    }
+
+    std::vector<std::string_view> Search(std::string_view query, size_t results_count,
+                                         QueryStats* stats = nullptr) const {
+        return GetSnapshot()->Search(query, results_count, query_cache_.Load().get(), stats);
+    }
+
+    std::vector<std::string_view> SearchPhrase(std::string_view phrase, size_t results_count, size_t slop = 0) const {
+        return GetSnapshot()->SearchPhrase(phrase, results_count, slop);
+    }
+
+    std::vector<std::vector<std::string_view>> SearchBatch(std::span<const std::string_view> queries,
+                                                           size_t results_count, size_t threads_count = 1) const {
+        return GetSnapshot()->SearchBatch(queries, results_count, threads_count);
+    }
+
+    bool Save(const std::string& path) const {
+        return GetSnapshot()->Save(path);
+    }
+
+    bool Load(const std::string& path) {
+        return Rebuild([&](SearchIndex& index) { return index.Load(path); });
+    }
+
+    // The current index, which does not change while it is held.
+    std::shared_ptr<const SearchIndex> GetSnapshot() const {
+        return snapshot_.Load();
+    }
+
+private:
+    IndexOptions options_;
+    std::shared_ptr<Corpus> corpus_ = std::make_shared<Corpus>();
+    RcuPointer<const SearchIndex> snapshot_{std::make_shared<const SearchIndex>(options_, corpus_)};
+    RcuPointer<QueryCache> query_cache_{nullptr};
+    std::mutex update_mutex_;
+
+    template <typename Callback>
+    bool Rebuild(Callback&& callback) {
+        std::lock_guard lock(update_mutex_);
+
+        return Publish(std::make_shared<SearchIndex>(options_, corpus_), callback);
+    }
+
+    template <typename Callback>
+    bool Publish(std::shared_ptr<SearchIndex> index, Callback& callback) {
+        if (!callback(*index)) {
+            return false;
+        }
+
+        snapshot_.Store(std::move(index));
+
+        return true;
     }
 };
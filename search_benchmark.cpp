@@ -0,0 +1,202 @@
+// Benchmark of the search engine on generated text, whose words follow Zipf's law as in natural
+// language. Prints one JSON object per line for every measurement, so that runs can be compared:
+//     g++ -std=c++20 -O2 -DNDEBUG search_benchmark.cpp -o search_benchmark && ./search_benchmark [lines_count...]
+// Build with -DSEARCH_ENGINE_STATS to also report the postings and candidates each query goes through.
+// Peak RSS is that of the whole process so far. Sizes run in increasing order, so it is the peak of
+// the largest one; run a single size per process to measure it alone.
+#include "search.cpp"
+
+#include <sys/resource.h>
+
+#include <charconv>
+#include <iostream>
+#include <random>
+#include <sstream>
+
+namespace {
+
+constexpr size_t VOCABULARY_SIZE = 50000;
+constexpr double ZIPF_EXPONENT = 1.0;
+constexpr size_t MIN_LINE_WORDS = 4;
+constexpr size_t MAX_LINE_WORDS = 16;
+constexpr size_t QUERIES_COUNT = 1000;
+constexpr size_t QUERY_LENGTHS[] = {1, 2, 4};
+constexpr size_t RESULTS_COUNTS[] = {1, 10, 100};
+constexpr size_t DEFAULT_LINES_COUNTS[] = {10000, 100000, 1000000};
+
+// Draws words by rank with probability proportional to 1 / rank^ZIPF_EXPONENT. Frequent words are
+// the short ones, as the word of rank r is r written in base 26 with letters.
+class ZipfWords {
+public:
+    ZipfWords() {
+        std::vector<double> weights(VOCABULARY_SIZE);
+
+        for (size_t rank = 0; rank < VOCABULARY_SIZE; ++rank) {
+            weights[rank] = 1.0 / std::pow(static_cast<double>(rank + 1), ZIPF_EXPONENT);
+
+            for (size_t n = rank + 1; n != 0; n = (n - 1) / 26) {
+                words_[rank].insert(words_[rank].begin(), static_cast<char>('a' + (n - 1) % 26));
+            }
+        }
+
+        ranks_ = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    }
+
+    const std::string& Next(std::mt19937_64& random) {
+        return words_[ranks_(random)];
+    }
+
+private:
+    std::vector<std::string> words_ = std::vector<std::string>(VOCABULARY_SIZE);
+    std::discrete_distribution<size_t> ranks_;
+};
+
+std::string GenerateText(ZipfWords& words, size_t lines_count, std::mt19937_64& random) {
+    std::uniform_int_distribution<size_t> line_words(MIN_LINE_WORDS, MAX_LINE_WORDS);
+    std::string text;
+
+    for (size_t line = 0; line < lines_count; ++line) {
+        for (size_t i = 0, count = line_words(random); i < count; ++i) {
+            text += words.Next(random);
+            text += i + 1 == count ? '\n' : ' ';
+        }
+    }
+
+    return text;
+}
+
+std::vector<std::string> GenerateQueries(ZipfWords& words, size_t query_length, std::mt19937_64& random) {
+    std::vector<std::string> queries(QUERIES_COUNT);
+
+    for (std::string& query : queries) {
+        for (size_t i = 0; i < query_length; ++i) {
+            query += i == 0 ? "" : " ";
+            query += words.Next(random);
+        }
+    }
+
+    return queries;
+}
+
+// In kilobytes, as Linux reports it.
+long GetPeakRss() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+double GetSeconds(std::chrono::steady_clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+}
+
+// Values of measurements are printed with a fixed number of decimals, so that lines are easy to diff.
+std::string Format(double value) {
+    char buffer[64];
+    auto [end, error] = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, 3);
+
+    return std::string(buffer, error == std::errc() ? end : buffer);
+}
+
+template <typename Build>
+void MeasureBuild(const char* name, std::string_view text, size_t lines_count, size_t threads_count, Build&& build) {
+    auto start = std::chrono::steady_clock::now();
+    build();
+    double seconds = GetSeconds(std::chrono::steady_clock::now() - start);
+
+    std::cout << "{\"benchmark\":\"" << name << "\",\"lines\":" << lines_count << ",\"bytes\":" << text.size()
+              << ",\"threads\":" << threads_count << ",\"seconds\":" << Format(seconds)
+              << ",\"mb_per_s\":" << Format(static_cast<double>(text.size()) / 1e6 / seconds)
+              << ",\"lines_per_s\":" << Format(static_cast<double>(lines_count) / seconds)
+              << ",\"peak_rss_kb\":" << GetPeakRss() << "}\n";
+}
+
+void MeasureSearch(const SearchEngine& engine, size_t lines_count, std::span<const std::string> queries,
+                   size_t query_length, size_t results_count) {
+    std::vector<double> latencies;
+    latencies.reserve(queries.size());
+    QueryStats stats;
+    size_t found_count = 0;
+
+    for (const std::string& query : queries) {
+        auto start = std::chrono::steady_clock::now();
+        found_count += engine.Search(query, results_count, &stats).size();
+        latencies.push_back(GetSeconds(std::chrono::steady_clock::now() - start) * 1e6);
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t percent) { return latencies[(latencies.size() - 1) * percent / 100]; };
+    double queries_count = static_cast<double>(queries.size());
+
+    std::cout << "{\"benchmark\":\"Search\",\"lines\":" << lines_count << ",\"query_words\":" << query_length
+              << ",\"k\":" << results_count << ",\"queries\":" << queries.size()
+              << ",\"p50_us\":" << Format(percentile(50)) << ",\"p90_us\":" << Format(percentile(90))
+              << ",\"p99_us\":" << Format(percentile(99)) << ",\"max_us\":" << Format(latencies.back())
+              << ",\"mean_found\":" << Format(static_cast<double>(found_count) / queries_count);
+
+    if (QUERY_STATS_ENABLED) {
+        std::cout << ",\"mean_postings_scanned\":"
+                  << Format(static_cast<double>(stats.postings_scanned) / queries_count)
+                  << ",\"mean_candidates_scored\":"
+                  << Format(static_cast<double>(stats.candidates_scored) / queries_count);
+    }
+
+    std::cout << "}\n";
+}
+
+void RunBenchmarks(ZipfWords& words, size_t lines_count) {
+    // Seeded with the size, so that every run measures the same text and queries for it.
+    std::mt19937_64 random(lines_count);
+    std::string text = GenerateText(words, lines_count, random);
+    size_t max_threads_count = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    SearchEngine engine;
+
+    for (size_t threads_count : {size_t{1}, max_threads_count}) {
+        MeasureBuild("BuildIndex", text, lines_count, threads_count, [&] { engine.BuildIndex(text, threads_count); });
+
+        std::istringstream input(text);
+        MeasureBuild("BuildIndexFromStream", text, lines_count, threads_count,
+                     [&] { engine.BuildIndexFromStream(input, threads_count); });
+
+        if (max_threads_count == 1) {
+            break;
+        }
+    }
+
+    for (size_t query_length : QUERY_LENGTHS) {
+        std::vector<std::string> queries = GenerateQueries(words, query_length, random);
+
+        for (size_t results_count : RESULTS_COUNTS) {
+            MeasureSearch(engine, lines_count, queries, query_length, results_count);
+        }
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    std::vector<size_t> lines_counts(std::begin(DEFAULT_LINES_COUNTS), std::end(DEFAULT_LINES_COUNTS));
+
+    if (argc > 1) {
+        lines_counts.clear();
+
+        for (int i = 1; i < argc; ++i) {
+            size_t lines_count = 0;
+            std::string_view arg = argv[i];
+
+            if (std::from_chars(arg.data(), arg.data() + arg.size(), lines_count).ptr != arg.data() + arg.size()) {
+                std::cerr << "Usage: " << argv[0] << " [lines_count...]\n";
+                return 1;
+            }
+
+            lines_counts.push_back(lines_count);
+        }
+    }
+
+    std::sort(lines_counts.begin(), lines_counts.end());
+    ZipfWords words;
+
+    for (size_t lines_count : lines_counts) {
+        RunBenchmarks(words, lines_count);
+    }
+}
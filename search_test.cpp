@@ -0,0 +1,329 @@
+// Tests of the search engine. Build with AddressSanitizer, so that dangling lines are reported:
+//     g++ -std=c++20 -O1 -g -fsanitize=address,undefined search_test.cpp -o search_test && ./search_test
+#include "search.cpp"
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+void TestLinesOfCopiedTextSurviveRebuild() {
+    SearchIndex index;
+    index.AddDocumentCopy(std::string("alpha beta\ngamma delta\n"));
+    std::vector<std::string_view> result = index.Search("alpha", 1);
+    index.BuildIndex("zzz\n");
+
+    assert(result.size() == 1);
+    assert(result[0] == "alpha beta");
+}
+
+void TestLinesOfStreamSurviveRebuild() {
+    SearchIndex index;
+    std::istringstream input("alpha beta\ngamma delta\n");
+    assert(index.BuildIndexFromStream(input));
+    std::vector<std::string_view> result = index.Search("gamma", 1);
+    index.BuildIndex("zzz\n");
+
+    assert(result.size() == 1);
+    assert(result[0] == "gamma delta");
+}
+
+void TestLinesOfLoadedIndexSurviveRebuild() {
+    const std::string path = "search_test.idx";
+    SearchIndex saved;
+    saved.BuildIndex("alpha beta\ngamma delta\n");
+    assert(saved.Save(path));
+
+    SearchIndex index;
+    assert(index.Load(path));
+    std::vector<std::string_view> result = index.Search("alpha", 1);
+    index.BuildIndex("zzz\n");
+    std::remove(path.c_str());
+
+    assert(result.size() == 1);
+    assert(result[0] == "alpha beta");
+}
+
+void TestEngineLinesSurviveRebuild() {
+    const std::string path = "search_test_engine.idx";
+    SearchEngine saved;
+    saved.BuildIndex("epsilon zeta\nlambda mu\n");
+    assert(saved.Save(path));
+
+    SearchEngine engine;
+    engine.AddDocumentCopy(std::string("alpha beta\ngamma delta\n"));
+    std::vector<std::string_view> lines = engine.Search("alpha", 1);
+    std::vector<std::string_view> phrase_lines = engine.SearchPhrase("gamma delta", 1);
+    std::string_view queries[] = {"beta", "delta"};
+    std::vector<std::vector<std::string_view>> batch_lines = engine.SearchBatch(queries, 1);
+
+    std::istringstream input("eta theta\niota kappa\n");
+    assert(engine.BuildIndexFromStream(input));
+    std::vector<std::string_view> stream_lines = engine.Search("eta", 1);
+
+    assert(engine.Load(path));
+    std::vector<std::string_view> loaded_lines = engine.Search("epsilon", 1);
+    engine.BuildIndex("zzz\n");
+    std::remove(path.c_str());
+
+    assert(lines.size() == 1 && lines[0] == "alpha beta");
+    assert(phrase_lines.size() == 1 && phrase_lines[0] == "gamma delta");
+    assert(batch_lines.size() == 2);
+    assert(batch_lines[0].size() == 1 && batch_lines[0][0] == "alpha beta");
+    assert(batch_lines[1].size() == 1 && batch_lines[1][0] == "gamma delta");
+    assert(stream_lines.size() == 1 && stream_lines[0] == "eta theta");
+    assert(loaded_lines.size() == 1 && loaded_lines[0] == "epsilon zeta");
+}
+
+void TestStreamReadExceptionIsPassedOn() {
+    SearchIndex index;
+    index.BuildIndex("zzz\n");
+    size_t reads_count = 0;
+    auto read = [&](char* buffer, size_t size) -> std::optional<size_t> {
+        if (++reads_count > 1) {
+            throw std::runtime_error("read failed");
+        }
+
+        std::string_view text = "alpha beta\ngamma";
+        size = std::min(size, text.size());
+        std::copy_n(text.data(), size, buffer);
+
+        return size;
+    };
+
+    bool thrown = false;
+
+    try {
+        index.AddDocumentFromStream(read);
+    } catch (const std::runtime_error&) {
+        thrown = true;
+    }
+
+    assert(thrown);
+    assert(index.GetLinesCount() == 1);
+    assert(index.Search("alpha", 1).empty());
+}
+
+void TestPhraseWithHugeSlop() {
+    SearchIndex index(IndexOptions{.store_word_positions = true});
+    index.BuildIndex("alpha beta gamma delta\nepsilon\n");
+    std::vector<std::string_view> result = index.SearchPhrase("alpha delta", 1, SIZE_MAX);
+
+    assert(result.size() == 1);
+    assert(result[0] == "alpha beta gamma delta");
+    assert(index.SearchPhrase("delta alpha", 1, SIZE_MAX).empty());
+}
+
+// Words of a line folded to lower case, split as the index splits them: at every byte that is
+// not an ASCII letter.
+std::vector<std::string> GetWords(std::string_view line) {
+    std::vector<std::string> words(1);
+
+    for (char c : line) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+            words.back().push_back(static_cast<char>(c | 0x20));
+        } else if (!words.back().empty()) {
+            words.emplace_back();
+        }
+    }
+
+    if (words.back().empty()) {
+        words.pop_back();
+    }
+
+    return words;
+}
+
+// Scores every live line by TF-IDF, term by term, the way Search defines relevance.
+class ExhaustiveScorer {
+public:
+    explicit ExhaustiveScorer(const std::vector<std::optional<std::string>>& lines) : lines_(lines) {
+        for (const auto& line : lines) {
+            if (!line) {
+                continue;
+            }
+
+            ++live_lines_count_;
+            std::vector<std::string> words = GetWords(*line);
+            std::sort(words.begin(), words.end());
+            words.erase(std::unique(words.begin(), words.end()), words.end());
+
+            for (const auto& word : words) {
+                ++document_frequencies_[word];
+            }
+        }
+    }
+
+    // Terms are summed in sorted order, as Search sums them.
+    double GetRelevance(std::string_view line, std::string_view query) const {
+        std::vector<std::string> terms = GetWords(query);
+        std::sort(terms.begin(), terms.end());
+        terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+        std::vector<std::string> words = GetWords(line);
+        double relevance = 0.0;
+
+        for (const auto& term : terms) {
+            auto it = document_frequencies_.find(term);
+
+            if (it == document_frequencies_.end()) {
+                continue;
+            }
+
+            double idf = std::log(static_cast<double>(live_lines_count_) / static_cast<double>(it->second));
+            double count = static_cast<double>(std::count(words.begin(), words.end(), term));
+
+            if (idf != 0.0 && count != 0.0) {
+                relevance += count / static_cast<double>(words.size()) * idf;
+            }
+        }
+
+        return relevance;
+    }
+
+    // Relevances of the results_count most relevant lines, in decreasing order.
+    std::vector<double> GetTopRelevances(std::string_view query, size_t results_count) const {
+        std::vector<double> relevances;
+
+        for (const auto& line : lines_) {
+            if (line) {
+                if (double relevance = GetRelevance(*line, query); relevance != 0.0) {
+                    relevances.push_back(relevance);
+                }
+            }
+        }
+
+        std::sort(relevances.begin(), relevances.end(), std::greater<>());
+        relevances.resize(std::min(relevances.size(), results_count));
+
+        return relevances;
+    }
+
+private:
+    const std::vector<std::optional<std::string>>& lines_;
+    std::map<std::string, size_t> document_frequencies_;
+    size_t live_lines_count_ = 0;
+};
+
+// Search has to find lines exactly as relevant as the exhaustive top, and the same lines as
+// SearchBatch, over several segments, removed lines, parallel builds and saved indexes.
+void TestSearchMatchesExhaustiveScoring() {
+    const std::string paths[] = {"search_test_a.idx", "search_test_b.idx"};
+
+    for (unsigned seed = 1; seed <= 6; ++seed) {
+        std::mt19937 random(seed);
+        auto next = [&](size_t bound) { return static_cast<size_t>(random() % bound); };
+        std::vector<std::string> vocabulary;
+
+        for (size_t i = 0; i < 40; ++i) {
+            std::string word;
+
+            for (size_t length = 1 + next(5); word.size() < length;) {
+                word.push_back(static_cast<char>((next(4) == 0 ? 'A' : 'a') + next(6)));
+            }
+
+            vocabulary.push_back(word);
+        }
+
+        // Words are drawn with a skewed distribution, so that some are in most lines.
+        auto word = [&] { return vocabulary[next(vocabulary.size()) * next(vocabulary.size()) / vocabulary.size()]; };
+        auto document = [&](size_t lines_count) {
+            std::string text;
+
+            for (size_t i = 0; i < lines_count; ++i) {
+                for (size_t j = 0, words_count = next(8); j < words_count; ++j) {
+                    text += word() + (next(4) == 0 ? ", " : " ");
+                }
+
+                text += '\n';
+            }
+
+            return text;
+        };
+
+        SearchEngine engine(IndexOptions{.store_word_positions = seed % 2 == 0});
+        engine.SetQueryCacheCapacity(seed % 3 == 0 ? 0 : 16);
+        // The lines of the engine by position, without the removed ones.
+        std::vector<std::optional<std::string>> lines;
+        size_t saves_count = 0;
+
+        for (size_t step = 0; step < 24; ++step) {
+            size_t operation = next(10);
+
+            if (operation < 5 || lines.empty()) {
+                std::string text = document(next(10) == 0 ? 3000 : 1 + next(60));
+                engine.AddDocumentCopy(text, 1 + next(3));
+
+                // Empty lines are not indexed and take no position.
+                for (size_t begin = 0, end = 0; (end = text.find('\n', begin)) != text.npos; begin = end + 1) {
+                    if (end != begin) {
+                        lines.emplace_back(text.substr(begin, end - begin));
+                    }
+                }
+            } else if (operation < 8) {
+                for (size_t i = 0, count = 1 + next(20); i < count; ++i) {
+                    size_t pos = next(lines.size());
+                    engine.RemoveLine(pos);
+                    lines[pos].reset();
+                }
+            } else {
+                // Saved to a file other than the one that is mapped.
+                const std::string& path = paths[saves_count++ % 2];
+                assert(engine.Save(path));
+                assert(engine.Load(path));
+            }
+
+            ExhaustiveScorer scorer(lines);
+            std::vector<std::string> queries;
+            std::vector<std::string_view> query_views;
+
+            for (size_t i = 0; i < 20; ++i) {
+                queries.push_back(word());
+
+                for (size_t words_count = next(4); words_count != 0; --words_count) {
+                    queries.back() += " " + word();
+                }
+            }
+
+            query_views.assign(queries.begin(), queries.end());
+            size_t results_count = 1 + next(12);
+            std::vector<std::vector<std::string_view>> batch_results =
+                engine.SearchBatch(query_views, results_count, 1 + next(3));
+
+            for (size_t i = 0; i < queries.size(); ++i) {
+                std::vector<std::string_view> result = engine.Search(queries[i], results_count);
+                std::vector<double> top_relevances = scorer.GetTopRelevances(queries[i], results_count);
+
+                assert(result == batch_results[i]);
+                assert(result.size() == top_relevances.size());
+
+                for (size_t j = 0; j < result.size(); ++j) {
+                    assert(std::abs(scorer.GetRelevance(result[j], queries[i]) - top_relevances[j]) < 1e-9);
+                }
+            }
+        }
+    }
+
+    for (const std::string& path : paths) {
+        std::remove(path.c_str());
+    }
+}
+
+}  // namespace
+
+int main() {
+    TestLinesOfCopiedTextSurviveRebuild();
+    TestLinesOfStreamSurviveRebuild();
+    TestLinesOfLoadedIndexSurviveRebuild();
+    TestEngineLinesSurviveRebuild();
+    TestStreamReadExceptionIsPassedOn();
+    TestPhraseWithHugeSlop();
+    TestSearchMatchesExhaustiveScoring();
+
+    std::cout << "OK\n";
+}